@@ -0,0 +1,73 @@
+// vec_ops.cpp
+// Microbenchmark of the vector operations of the renderer, in ns per operation over 4096 vectors.
+// Build it with the flags of the renderer to compare the vector types, e.g.
+// `make bench`, `make bench SIMD=1`, `make bench SINGLE_PRECISION=1 SIMD=1`.
+
+#include "utils/common.hpp"
+#include "utils/vec.hpp"
+#include "utils/random.hpp"
+#include "primitives/sphere.hpp"
+#include <chrono>
+#include <cstdio>
+
+using namespace raytracer;
+
+const int N = 4096;     // vectors per run
+const int RUNS = 2000;  // runs of each operation, the best one is reported
+
+// runs f RUNS times and prints the best time per vector
+template<typename F>
+void bench(const char* name, F f) {
+  double best = 1e30;
+  for (int r = 0; r < RUNS; r++) {
+    auto start = std::chrono::high_resolution_clock::now();
+    f();
+    auto end = std::chrono::high_resolution_clock::now();
+    best = std::min(best, std::chrono::duration<double>(end - start).count());
+  }
+  std::printf("%-14s %8.2f ns/op\n", name, best * 1e9 / N);
+}
+
+int main() {
+  std::printf("%s, %s\n", sizeof(Real) == 4 ? "float" : "double",
+#ifdef SIMD
+              "simd::Vec3");
+#else
+              "glm");
+#endif
+
+  random::Sampler sampler(random::SamplerType::independent, 1, 0, 0, 1);
+  std::vector<Vec> a(N), b(N), out(N);
+  for (int i = 0; i < N; i++) {
+    a[i] = random::vec(sampler, -1, 1);
+    b[i] = vec::normalize(random::vec(sampler, -1, 1));
+  }
+
+  // the results are stored so that the loops are not optimized away
+  volatile Real sink = 0;
+  bench("dot", [&]() { Real acc = 0; for (int i = 0; i < N; i++) acc += vec::dot(a[i], b[i]); sink = acc; });
+  bench("cross", [&]() { for (int i = 0; i < N; i++) out[i] = vec::cross(a[i], b[i]); });
+  bench("normalize", [&]() { for (int i = 0; i < N; i++) out[i] = vec::normalize(a[i]); });
+  bench("divide", [&]() { for (int i = 0; i < N; i++) out[i] = Real(1) / b[i]; });
+  bench("colour a*b*s+c", [&]() { for (int i = 0; i < N; i++) out[i] += a[i] * b[i] * Real(0.5); });
+  bench("change_basis", [&]() { for (int i = 0; i < N; i++) out[i] = vec::change_basis(b[i], a[i]); });
+
+  Sphere sphere(Point(0, 0, -1), 0.5, nullptr);
+  bench("Sphere::hit", [&]() {
+    int hits = 0;
+    for (int i = 0; i < N; i++) {
+      HitRecord rec;
+      hits += sphere.hit(Ray(a[i], b[i]), Interval(0, infinity), rec);
+    }
+    sink = hits;
+  });
+
+  // the padding lane of simd::Vec3 stays at zero through all the operations
+  Real padding = 0;
+#ifdef SIMD
+  for (int i = 0; i < N; i++)
+    padding += std::abs((Real(1) / b[i]).pad) + std::abs((a[i] / b[i]).pad);
+#endif
+  std::printf("padding check: %s\n", padding == 0 ? "ok" : "FAILED");
+  return padding == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,86 @@
+// warps.cpp
+// Microbenchmark of the sample warps, in millions of samples per second over 4096 samples:
+// the warps with libm sin/cos they replaced, and the warps of random.hpp.
+// Also checks the accuracy of the polynomial sincos_2pi against libm.
+
+#include "utils/common.hpp"
+#include "utils/random.hpp"
+#include <chrono>
+#include <cstdio>
+
+using namespace raytracer;
+
+const int N = 4096;   // samples per run
+const int RUNS = 30;  // runs of each warp, the best one is reported
+const int REPS = 20;  // passes over the samples in each run
+
+alignas(64) Real U[N], V[N], X[N], Y[N], Z[N];
+
+
+// warps with libm sin/cos
+inline void libm_disk(Real u, Real v, Real& x, Real& y) {
+  Real rho = std::sqrt(u);
+  Real phi = Real(2*M_PI) * v;
+  x = rho * std::cos(phi);
+  y = rho * std::sin(phi);
+}
+
+inline void libm_sphere(Real u, Real v, Real& x, Real& y, Real& z) {
+  z = 1 - 2*u;
+  Real r = std::sqrt(1 - z*z);
+  Real phi = Real(2*M_PI) * v;
+  x = r * std::cos(phi);
+  y = r * std::sin(phi);
+}
+
+inline void libm_hemisphere_cosine(Real u, Real v, Real& x, Real& y, Real& z) {
+  Real phi = Real(2*M_PI) * v;
+  x = std::cos(phi) * std::sqrt(u);
+  y = std::sin(phi) * std::sqrt(u);
+  z = std::sqrt(1 - u);
+}
+
+
+// runs f RUNS times and returns the best throughput, in Msamples/s
+template<typename F>
+double bench(F f) {
+  double best = 1e30;
+  for (int r = 0; r < RUNS; r++) {
+    auto start = std::chrono::high_resolution_clock::now();
+    for (int rep = 0; rep < REPS; rep++) {
+      f();
+      asm volatile("" ::: "memory"); // the outputs are not optimized away
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    best = std::min(best, std::chrono::duration<double>(end - start).count());
+  }
+  return (double)REPS * N / best / 1e6;
+}
+
+int main() {
+  random::Sampler sampler(random::SamplerType::independent, 1, 2, 3, 4);
+  for (int i = 0; i < N; i++) {
+    U[i] = random::rand(sampler);
+    V[i] = random::rand(sampler);
+  }
+
+  double error = 0;
+  for (int i = 0; i < N; i++) {
+    Real s, c;
+    random::sincos_2pi(V[i], s, c);
+    error = std::max(error, (double)std::abs(s - std::sin(Real(2*M_PI) * V[i])));
+    error = std::max(error, (double)std::abs(c - std::cos(Real(2*M_PI) * V[i])));
+  }
+  std::printf("%s, sincos_2pi max error vs libm: %.2g\n", sizeof(Real) == 4 ? "float" : "double", error);
+
+  std::printf("%-10s %8s %8s  (Msamples/s)\n", "", "libm", "poly");
+  std::printf("%-10s %8.0f %8.0f\n", "disk",
+    bench([]() { for (int i = 0; i < N; i++) libm_disk(U[i], V[i], X[i], Y[i]); }),
+    bench([]() { for (int i = 0; i < N; i++) random::warp_disk(U[i], V[i], X[i], Y[i]); }));
+  std::printf("%-10s %8.0f %8.0f\n", "sphere",
+    bench([]() { for (int i = 0; i < N; i++) libm_sphere(U[i], V[i], X[i], Y[i], Z[i]); }),
+    bench([]() { for (int i = 0; i < N; i++) random::warp_sphere(U[i], V[i], X[i], Y[i], Z[i]); }));
+  std::printf("%-10s %8.0f %8.0f\n", "cosine",
+    bench([]() { for (int i = 0; i < N; i++) libm_hemisphere_cosine(U[i], V[i], X[i], Y[i], Z[i]); }),
+    bench([]() { for (int i = 0; i < N; i++) random::warp_hemisphere_cosine(U[i], V[i], X[i], Y[i], Z[i]); }));
+}
@@ -5,73 +5,88 @@
 #include "utils/random.hpp"
 #include "hittable/hit_record.hpp"
 #include "scene.hpp"
+#include "compiled_scene.hpp"
 #include "material.hpp"
+#include "material_dispatch.hpp"
+#include "integrator.hpp"
 
 namespace raytracer {
 
 // A camera that can render a scene.
 class Camera {
   public:
-    double aspect_ratio = 1.0;      // ratio width/height
+    Real aspect_ratio = 1.0;        // ratio width/height
     int image_width = 100;          // image width in pixel count
-    int samples_per_pixel = 9;      // number of random samples for each pixel, must be a square number for stratified sampling (1, 4, 9, 16, ...)
+    int samples_per_pixel = 9;      // number of random samples for each pixel, powers of two are best stratified by the Sobol sampler
     int max_depth = 10;             // maximum number of ray bounces into scene
     int min_depth = 4;              // minimum number of ray bounces into scene, for russian roulette
-    bool enable_MIS = false;        // enable Multiple Importance Sampling (MIS) for light and surface sampling
+    bool enable_MIS = false;        // enable Multiple Importance Sampling (MIS) of light and BSDF samples, with the power heuristic
     bool russian_roulette = true;   // enable russian roulette for path termination
-
-    double vfov = 90.0;             // vertical field of view in degrees
+    bool next_event_estimation = true; // sample a light at each bounce, otherwise lights are only found by hitting them
+    int tile_size = 16;             // side of the square image tiles rendered by each thread
+    uint64_t seed = 0;              // seed of the random number generators, each pixel sample has its own generator
+    random::SamplerType sampler_type = random::SamplerType::sobol; // distribution of the samples of each pixel
+    int first_sample = 0;           // index of the first sample of each pixel, to render sample ranges separately and merge them
+    PixelFormat pixel_format = PixelFormat::rgb; // framebuffer format, rgba stores per-pixel sample counts
+    bool tiled_framebuffer = true;  // store the framebuffer tile by tile instead of in scanline order
+
+    Real vfov = 90.0;               // vertical field of view in degrees
     Point look_from = Point(0,0,0); // camera location
     Point look_at = Point(0,0,-1);  // camera target
     Vec vup = Vec(0, 1, 0);         // camera up vector (view up)
 
-    double defocus_angle = 0.0;     // angle of the cone with apex at the viewpoint and base at the camera center (0 = no defocus)
-    double focus_dist = 1;          // distance from camera to focus plane
+    Real defocus_angle = 0.0;       // angle of the cone with apex at the viewpoint and base at the camera center (0 = no defocus)
+    Real focus_dist = 1;            // distance from camera to focus plane
 
 
     // constructors and destructors
     Camera() = default;
-    Camera(Scene scene) : scene(scene) {}
+    Camera(const Scene& scene) : scene(scene.compile()) {}
     ~Camera() = default;
 
-    // render the image row by row, from top to bottom
+    // render the image with the kernel specialized for the camera settings and the scene shape
     void render() {
       initialize();
-      double pixels_sample_scale = 1.0 / samples_per_pixel;
+      memory_usage().print(std::clog);
+
+      size_t allocations = memory::allocations();
+      scene.select_shape([&](auto shape) {
+        integrator::select(russian_roulette, next_event_estimation, enable_MIS, max_depth, [&](auto policy) {
+          render_tiles<decltype(policy), decltype(shape)>();
+        });
+      });
+      if (memory::tracking_allocations()) {
+        // the render loop should not allocate
+        allocations = memory::allocations() - allocations;
+        memory::add_render_allocations(allocations);
+        double samples = (double)image_width * image_height * samples_per_pixel;
+        std::clog << "Render heap allocations: " << allocations
+                  << " (" << allocations / samples << " per sample)" << std::endl;
+      }
 
-    #ifdef OPENMP
-      // CPU parallelization
-      #pragma omp parallel for schedule(static)
-    #endif
+      utils::write_image(framebuffer);
+    }
 
-      for (int j = 0; j < image_height; ++j) {
-        for (int i = 0; i < image_width; ++i) {
-          auto pixel_colour = Colour(0);
-          for (int sample_idx = 0; sample_idx < samples_per_pixel; ++sample_idx) {
-            Ray r = ray_sample(i, j, sample_idx);
-            // pixel_colour += ray_trace(r);
-            pixel_colour += path_trace(r);
-          }
-          pixels[j][i] = pixel_colour * pixels_sample_scale;
-        }
-      }
-      utils::write_image(image_width, image_height, pixels);
+    // memory used by the scene and the image, in bytes
+    memory::Report memory_usage() const {
+      memory::Report report = scene.memory_usage();
+      report.framebuffer = framebuffer.memory_usage();
+      return report;
     }
 
 
   private:
-    int image_height;         // image height in pixel count
-    Point center;             // camera center
-    Point viewport_origin;    // upper left corner of the viewport
-    Vec pixel_delta_u;        // offset to pixel to the right
-    Vec pixel_delta_v;        // offset to pixel below
-    Vec u, v, w;              // camera coordinate system
-    Vec defocus_u, defocus_v; // defocus vectors, u is horizontal, v is vertical
-    bool initialized = false; // flag to check if the camera has been initialized
-    int sqrt_spp;             // square root of samples_per_pixel
-    const Scene scene;        // scene to render
-
-    std::vector<std::vector<Colour>> pixels; // image pixel data
+    int image_height;           // image height in pixel count
+    Point center;               // camera center
+    Point viewport_origin;      // upper left corner of the viewport
+    Vec pixel_delta_u;          // offset to pixel to the right
+    Vec pixel_delta_v;          // offset to pixel below
+    Vec u, v, w;                // camera coordinate system
+    Vec defocus_u, defocus_v;   // defocus vectors, u is horizontal, v is vertical
+    bool initialized = false;   // flag to check if the camera has been initialized
+    const CompiledScene scene;  // render-time representation of the scene to render
+
+    Framebuffer framebuffer;    // image pixel data
 
     void initialize() {
       if (initialized) return;
@@ -88,15 +103,15 @@ class Camera {
 
       // the viewport is a virtual window that we use to render the image
       // it is a grid of pixels, with the same aspect ratio as the image
-      double theta = glm::radians(vfov);
-      double h = glm::tan(theta/2.0);
-      double viewport_height = 2.0 * h * focus_dist;
-      double viewport_width = viewport_height * (static_cast<double>(image_width)/image_height);
+      Real theta = glm::radians(vfov);
+      Real h = glm::tan(theta/2.0);
+      Real viewport_height = 2.0 * h * focus_dist;
+      Real viewport_width = viewport_height * (static_cast<Real>(image_width)/image_height);
 
       // the camera coordinate system is defined by the look_from, look_at, and vup vectors
-      w = glm::normalize(look_from - look_at); // camera forward direction
-      u = glm::normalize(glm::cross(vup, w));  // camera right direction
-      v = glm::cross(w, u);                    // camera up direction
+      w = vec::normalize(look_from - look_at); // camera forward direction
+      u = vec::normalize(vec::cross(vup, w));  // camera right direction
+      v = vec::cross(w, u);                    // camera up direction
 
       // the vectors vu and vv define the viewport in the scene coordinates
       // the viewport is centered at the camera, and the camera is looking towards the negative z-axis
@@ -104,70 +119,85 @@ class Camera {
       Vec viewport_v = -v * viewport_height;
 
       // these are the deltas for the pixel coordinates in the viewport
-      pixel_delta_u = viewport_u / static_cast<double>(image_width);
-      pixel_delta_v = viewport_v / static_cast<double>(image_height);
+      pixel_delta_u = viewport_u / static_cast<Real>(image_width);
+      pixel_delta_v = viewport_v / static_cast<Real>(image_height);
 
       // in the image coordinates, the Y axis is flipped and the origin is at the top left corner
       // the top left corner of the image has coordinates (0, 0), and the bottom right
       // corner has coordinates (image_width, image_height).
       // we must calculate the location of the upper left pixel in the viewport coordinates
-      viewport_origin = center - (focus_dist * w) - viewport_u/2.0 - viewport_v/2.0;
+      viewport_origin = center - (focus_dist * w) - viewport_u/Real(2) - viewport_v/Real(2);
 
       // camera defocus disk factors
-      double defocus_radius = focus_dist * glm::tan(glm::radians(defocus_angle)/2.0);
+      Real defocus_radius = focus_dist * glm::tan(glm::radians(defocus_angle)/2.0);
       defocus_u = u * defocus_radius;
       defocus_v = v * defocus_radius;
 
-      // store square root of samples_per_pixel for stratified sampling
-      sqrt_spp = static_cast<int>(std::sqrt(samples_per_pixel));
-
       // pre-allocate memory for the image
-      pixels.resize(image_height);
-      for (int j = 0; j < image_height; ++j)
-        pixels[j].resize(image_width);
+      framebuffer = Framebuffer(image_width, image_height, samples_per_pixel, pixel_format,
+                                tiled_framebuffer ? tile_size : 0);
     }
 
-    // Simple ray tracing algorithm with basic path tracing (recursive).
-    Colour ray_trace(const Ray& r_in, int depth = 0) const {
-      // if we've exceeded the ray bounce limit, the ray was absorbed
-      if (depth >= max_depth)
-        return Colour(0);
-
-      // try to hit an object in the scene, starting at 0.0001 to avoid self-intersection
-      // misses are considered as ambient_light colour
-      HitRecord hit;
-      if (!scene.hit(r_in, Interval(0.0001, infinity), hit))
-        return scene.ambient_light;
-
-      // HIT //
+    // render all the tiles of the image with the kernel of the given integrator policy and scene shape
+    template<typename Policy, typename Shape>
+    void render_tiles() {
+      int ntiles_x = (image_width + tile_size - 1) / tile_size;
+      int ntiles_y = (image_height + tile_size - 1) / tile_size;
 
-      EvalRecord eval = hit.object->material->evaluate(scene, r_in, hit);
+    #ifdef OPENMP
+      // CPU parallelization
+      #pragma omp parallel for schedule(dynamic)
+    #endif
 
-      // ray bounced and has a pdf (Diffuse)
-      if (eval.pdf != nullptr)
-        return eval.colour * ray_trace(Ray(hit.p, eval.pdf->generate()), depth+1);
+      for (int tile = 0; tile < ntiles_x*ntiles_y; ++tile)
+        render_tile<Policy, Shape>((tile % ntiles_x) * tile_size, (tile / ntiles_x) * tile_size);
+    }
 
-      // ray bounced and has a fixed direction (reflection)
-      else if (eval.ray != nullptr)
-        return eval.colour * ray_trace(*eval.ray, depth+1);
+    // render the tile with upper left pixel (x0, y0).
+    // the tiles do not overlap, so each thread writes its own pixels of the framebuffer
+    template<typename Policy, typename Shape>
+    void render_tile(int x0, int y0) {
+      int x1 = std::min(x0 + tile_size, image_width);
+      int y1 = std::min(y0 + tile_size, image_height);
 
-      // ray was absorbed (Light and Phong materials)
-      else
-        return eval.colour;
+      for (int j = y0; j < y1; ++j) {
+        for (int i = x0; i < x1; ++i) {
+          auto pixel_colour = Colour(0);
+          uint64_t pixel = (uint64_t)j * image_width + i;
+          for (int sample_idx = first_sample; sample_idx < first_sample + samples_per_pixel; ++sample_idx) {
+            random::Sampler sampler(sampler_type, seed, pixel, sample_idx, samples_per_pixel);
+            Ray r = ray_sample(i, j, sampler);
+            pixel_colour += path_trace<Policy, Shape>(r, sampler);
+          }
+          framebuffer.add(i, j, pixel_colour, samples_per_pixel);
+        }
+      }
     }
 
-    // Iterative path tracing algorithm.
-    Colour path_trace(Ray& ray) const {
+    // Iterative path tracing algorithm, specialized at compile time by the integrator Policy
+    // and by the Shape of the scene (the kinds of primitives and materials it contains).
+    // Without next event estimation, it is a plain path tracer that only finds lights by hitting them.
+    // With next event estimation, the direct light of surfaces with a BSDF pdf (Diffuse) comes from
+    // light samples, and with MIS also from the BSDF sampled rays that hit a light, the two
+    // estimates being combined with the power heuristic. All variants converge to the same image.
+    // The random numbers of the path are drawn from sampler.
+    template<typename Policy, typename Shape>
+    Colour path_trace(Ray& ray, random::Sampler& sampler) const {
       auto L    = Colour(0); // accumulated radiance
       auto beta = Colour(1); // ponderation factor for the path
+      Real bsdf_pdf = 0;     // density of the BSDF sample that gave the ray, 0 for camera rays and specular bounces
+      Point bsdf_point(0);   // hit point the BSDF sampled ray leaves from, where the lights were sampled
+      Vec bsdf_normal(0);    // normal at bsdf_point
 
-      for (int depth = 0; depth < max_depth; ++depth) {
+      // a depth known at compile time lets the compiler unroll the loop
+      const int depth_limit = (Policy::max_depth > 0) ? Policy::max_depth : max_depth;
+      for (int depth = 0; depth < depth_limit; ++depth) {
         // russian roulette
         // https://www.pbr-book.org/3ed-2018/Monte_Carlo_Integration/Russian_Roulette_and_Splitting
-        if (russian_roulette && depth > min_depth) {
+        if (Policy::russian_roulette && depth > min_depth) {
           // continuation probability (at least 10%)
-          double p = utils::max({beta.r, beta.g, beta.b, 0.1});
-          if (random::rand() > p) {
+          Real p = utils::max({beta.r, beta.g, beta.b, Real(0.1)});
+          if (random::rand(sampler) > p) {
             // std::clog << "---" << std::endl;
             // std::clog << "Russian roulette end at {depth, p} = {" << depth << ", " << p << "}" << std::endl;
             // vec::print(beta);
@@ -177,66 +207,80 @@ class Camera {
           beta /= p;
         }
 
-        // try to hit an object in the scene, starting at 0.0001 to avoid self-intersection
+        // try to hit an object in the scene, secondary rays are offset from the surface they leave
         // misses are considered as ambient_light colour
         HitRecord hit;
-        if (!scene.hit(ray, Interval(0.0001, infinity), hit)) {
+        if (!scene.hit<Shape>(ray, Interval(0, infinity), hit)) {
           return L + beta * scene.ambient_light;
         }
 
         // HIT //
 
         // evaluate the material at the hit point
-        auto mat = hit.object->material;
-        EvalRecord eval = mat->evaluate(scene, ray, hit);
+        const Material* mat = hit.material;
+        EvalRecord eval = dispatch::visit<Shape>(*mat, [&](const auto& m) { return m.evaluate(scene, ray, hit, sampler); });
 
         // light source
-        if (std::dynamic_pointer_cast<LightMat>(mat)) {
-          // TODO: we should only count direct light sources at the first hit.
-          // doing so decreases the variance, but we lose part of the light
-          // reflection on Diffuse scene objects, which looks less realistic.
-          return (depth == 0) ? eval.colour : L;
-          // return eval.colour; // more noise, but more realistic
+        if (hit.object->emitter) {
+          // without next event estimation, hitting a light is the only way to collect its light,
+          // and so it is after camera rays and specular bounces, whose direction lights cannot sample
+          if (!Policy::nee || bsdf_pdf == 0)
+            return L + beta * eval.colour;
+
+          // the light was also sampled at the previous vertex, MIS weights the two estimates
+          if (Policy::mis)
+            return L + beta * eval.colour * integrator::power_heuristic(bsdf_pdf, scene.light_pdf(bsdf_point, bsdf_normal, ray.direction(), hit));
+          return L;
         }
 
-        // end path shooting a last ray to a light source
-        Colour Le = scene.get_light_radiance(hit);
-        L += Le * beta * eval.colour * mat->brdf_factor();
+        // next event estimation: shoot a ray to a light source
+        if (Policy::nee && eval.pdf) {
+          LightSample ls = scene.sample_direct_light<Shape>(hit, sampler);
+          if (ls.pdf > 0) {
+            Ray light_ray(hit.p, ls.wi);
+            Real scatter_pdf = dispatch::visit<Shape>(*mat, [&](const auto& m) { return m.scatter_pdf(hit.normal(), light_ray); });
+            Real weight = Policy::mis ? integrator::power_heuristic(ls.pdf, eval.pdf.value(ls.wi)) : 1;
+            L += beta * eval.colour * ls.radiance * (scatter_pdf * weight / ls.pdf);
+          }
+        }
 
         if (eval.pdf) {
           // ray bounced and has a pdf (Diffuse)
-          ray = Ray(hit.p, eval.pdf->generate());
-          double pdf = eval.pdf->value(ray.direction());
-          double scatter_pdf = mat->scatter_pdf(hit.normal(), ray);
-          beta *= eval.colour * scatter_pdf / pdf;
-        } else if (eval.ray) {
+          ray = hit.spawn_ray(eval.pdf.generate(sampler));
+          bsdf_pdf = eval.pdf.value(ray.direction());
+          bsdf_point = hit.p;
+          bsdf_normal = hit.normal();
+          if (bsdf_pdf <= 0)
+            return L;
+          Real scatter_pdf = dispatch::visit<Shape>(*mat, [&](const auto& m) { return m.scatter_pdf(hit.normal(), ray); });
+          beta *= eval.colour * scatter_pdf / bsdf_pdf;
+        } else if (eval.has_ray) {
           // ray bounced and has a fixed direction (simple reflection)
-          ray = *eval.ray;
+          ray = eval.ray;
           beta *= eval.colour;
+          bsdf_pdf = 0;
         } else {
-          // ray was absorbed (Phong materials)
-          return eval.colour;
+          // ray was absorbed: the colour is the light leaving the surface (shaded Phong materials),
+          // or 0 for materials that absorb the ray (Metal rays scattered below the surface)
+          return L + beta * eval.colour;
         }
       }
       return L;
     }
 
 
-    // get a stratified sampled camera ray for the pixel at location i,j
-    // sample_idx is the index of the sample in the pixel, used to stratify the samples
-    Ray ray_sample(int i, int j, int sample_idx) const {
+    // get a sampled camera ray for the pixel at location i,j
+    // the pixel positions of the samples of a pixel are stratified by the sampler
+    Ray ray_sample(int i, int j, random::Sampler& sampler) const {
       // pixel position
-      Point pixel_upper_left = viewport_origin + ((double)i * pixel_delta_u) + ((double)j * pixel_delta_v);
-      Point pixel_pos = random::sample_quad(pixel_upper_left, pixel_delta_u, pixel_delta_v);
-
-      // TODO: stratified sampling not working
-      // Point pixel_pos = random::sample_quad_stratified(pixel_upper_left, pixel_delta_u, pixel_delta_v, sample_idx, sqrt_spp);
+      Point pixel_upper_left = viewport_origin + ((Real)i * pixel_delta_u) + ((Real)j * pixel_delta_v);
+      Point pixel_pos = random::sample_quad(sampler, pixel_upper_left, pixel_delta_u, pixel_delta_v);
 
       // ray center
       Point ray_origin = center;
       if (defocus_angle > 0) {
         // if defocus is enabled, the ray origin is a random point in the camera defocus disk
-        Point p = random::sample_disk(1);
+        Point p = random::sample_disk(sampler, 1);
         ray_origin += (p.x * defocus_u) + (p.y * defocus_v);
       }
 
@@ -0,0 +1,389 @@
+#pragma once
+
+#include "utils/common.hpp"
+#include "utils/interval.hpp"
+#include "utils/random.hpp"
+#include "utils/memory.hpp"
+#include "hittable/hit_record.hpp"
+#include "hittable/bvh.hpp"
+#include "primitives/primitive.hpp"
+#include "primitives/sphere.hpp"
+#include "primitives/2d.hpp"
+#include "primitives/box.hpp"
+#include "primitives/mesh.hpp"
+#include "material.hpp"
+#include "scene.hpp"
+#include "scene_shape.hpp"
+#include "light_bvh.hpp"
+
+namespace raytracer {
+
+// A light source of the compiled scene.
+class Light {
+  public:
+    const Primitive* object;  // emitting primitive
+    const LightMat* material; // emission of the primitive
+};
+
+// A sample of the direct light arriving at a point.
+class LightSample {
+  public:
+    Vec wi;          // direction to the sampled light point, normalized
+    Colour radiance; // radiance emitted towards the point, zero if the light point is not visible
+    Real pdf;        // solid angle density of wi, including the probability of picking the light
+};
+
+// relative distance before a sampled light point where shadow rays stop,
+// so that the light surface itself does not occlude the point
+const Real SHADOW_EPSILON = 1e-3;
+
+
+// The immutable render-time representation of a Scene, built by Scene::compile().
+// Composite primitives (boxes, meshes) are flattened into their quads and triangles,
+// which are stored by value in contiguous per-type arrays, so the intersection code
+// calls them directly and without pointer chasing. A BVH over all these leaf primitives
+// replaces the linear scan of the scene, and a light BVH picks the lights that light each point.
+// The compiled scene is never modified while rendering, so it can be shared by all render
+// threads without synchronization.
+class CompiledScene {
+  public:
+    // A reference to a leaf primitive, in BVH leaf order.
+    class PrimRef {
+      public:
+        PrimitiveKind kind; // sphere, quad, triangle, or other for primitives of unknown type
+        int index;          // index in the array of its kind
+        int object;         // index of the scene object it belongs to
+        int material;       // index in the material table
+    };
+
+    Colour ambient_light = Colour(0); // scene ambient light colour
+    Colour background = Colour(0);    // scene background colour - only used by Phong materials
+
+    std::vector<Sphere> spheres;             // leaf spheres
+    std::vector<Quad> quads;                 // leaf quads, including the faces of boxes
+    std::vector<Triangle> triangles;         // leaf triangles, including the triangles of meshes
+    std::vector<const Primitive*> others;    // primitives of unknown type, called through virtual calls
+    std::vector<PrimRef> refs;               // leaf primitives, in BVH leaf order
+    std::vector<const Material*> materials;  // material table
+    std::vector<Light> lights;               // light table
+    BVH bvh;                                 // acceleration structure over refs
+    unsigned primitive_kinds = 0;            // kinds of the leaf primitives, as a mask of kind_bit()
+    unsigned material_kinds = 0;             // kinds of the materials, as a mask of kind_bit()
+
+    CompiledScene() = default;
+
+    // calls func(shape) with the most specialized shape that supports the scene
+    template<typename Func>
+    void select_shape(Func&& func) const {
+      shape::select(primitive_kinds, material_kinds, func);
+    }
+
+    // find the closest hit with the BVH, the hit record is only finalized for the closest hit.
+    // Shape must support the scene, see select_shape()
+    template<typename Shape = shape::Generic>
+    bool hit(const Ray& r, Interval ray_t, HitRecord& hit) const {
+      int closest = -1;
+      bvh.traverse(r, ray_t, [&](int i, Interval& t) {
+        if (!hit_leaf<Shape>(refs[i], r, t, hit))
+          return false;
+        closest = i;
+        t.max = hit.t;
+        return true;
+      });
+      if (closest < 0)
+        return false;
+
+      finalize_leaf<Shape>(refs[closest], r, hit);
+      return true;
+    }
+
+    // memory used by each part of the compiled scene, in bytes.
+    // The scene graph the scene was compiled from is not counted.
+    memory::Report memory_usage() const {
+      memory::Report report;
+      report.geometry = spheres.capacity()*sizeof(Sphere) + quads.capacity()*sizeof(Quad)
+                      + triangles.capacity()*sizeof(Triangle) + others.capacity()*sizeof(const Primitive*)
+                      + refs.capacity()*sizeof(PrimRef) + objects.capacity()*sizeof(shared_ptr<const Primitive>);
+      report.bvh = bvh.memory_usage();
+      report.materials = materials.capacity()*sizeof(const Material*);
+      for (const Material* mat : materials)
+        report.materials += mat->memory_usage();
+      report.lights = lights.capacity()*sizeof(Light) + light_bvh.memory_usage()
+                    + light_ids.size()*(sizeof(const Primitive*) + sizeof(int));
+      return report;
+    }
+
+    // Picks a light for the point p of normal n with the light BVH, by its estimated contribution.
+    // Returns nullptr if no light can reach p, otherwise sets probability to the probability of the light.
+    const Light* sample_light(const Point& p, const Vec& n, random::Sampler& sampler, Real& probability) const {
+      int light = light_bvh.sample(p, n, random::rand(sampler), probability);
+      return light < 0 ? nullptr : &lights[light];
+    }
+
+    // probability that sample_light() picks the light of the given emitter for the point p of normal n
+    Real light_probability(const Point& p, const Vec& n, const Primitive* emitter) const {
+      auto it = light_ids.find(emitter);
+      return it == light_ids.end() ? 0 : light_bvh.probability(p, n, it->second);
+    }
+
+    // Samples the direct light arriving at the hit point: picks a light, samples a point on it
+    // and traces a shadow ray to that point. The radiance is zero if the point is occluded
+    // or if it is seen from the back of the light.
+    template<typename Shape = shape::Generic>
+    LightSample sample_direct_light(const HitRecord& hit, random::Sampler& sampler) const {
+      LightSample ls{Vec(0), Colour(0), 0};
+      if (lights.empty())
+        return ls;
+
+      // sample a light from the scene, then a point on its surface
+      Real light_probability;
+      const Light* light = sample_light(hit.p, hit.normal(), sampler, light_probability);
+      if (!light)
+        return ls;
+      Sample sample = light->object->pdf_sample(hit.p, sampler);
+      Vec to_light = sample.p - hit.p;
+      Real distance = vec::length(to_light);
+      ls.wi = to_light / distance;
+      if (vec::dot(-ls.wi, sample.normal) <= 0)
+        return ls;
+
+      ls.pdf = light_probability * sample.pdf;
+      if (ls.pdf <= 0)
+        return ls;
+
+      // shadow ray, anything before the sampled point occludes it
+      HitRecord shadow_hit;
+      if (this->hit<Shape>(hit.spawn_ray(ls.wi), Interval(0, distance * (1 - SHADOW_EPSILON)), shadow_hit))
+        return ls;
+      ls.radiance = light->material->radiance(distance);
+      return ls;
+    }
+
+    // Solid angle density of sample_direct_light() at the point p of normal n for the given direction,
+    // where light_hit is the hit on an emitter of the ray leaving p in that direction.
+    // Used to weight BSDF sampled rays that hit a light. p is the hit point where the lights were
+    // sampled, not the offset origin of the ray, so that both densities are measured from the same point.
+    Real light_pdf(const Point& p, const Vec& n, const Vec& direction, const HitRecord& light_hit) const {
+      Real probability = light_probability(p, n, light_hit.object);
+      if (probability <= 0)
+        return 0;
+      return probability * light_hit.object->pdf_value(Ray(p, direction));
+    }
+
+  private:
+    friend class Scene;
+
+    std::vector<shared_ptr<const Primitive>> objects; // scene objects, kept alive while rendering
+    LightBVH light_bvh;                               // hierarchy of the lights, to sample them
+    std::unordered_map<const Primitive*, int> light_ids; // index of each emitter in the light table
+
+    // intersection test of a leaf primitive, with direct calls for the known types.
+    // Only the primitive kinds of the Shape are tested
+    template<typename Shape>
+    bool hit_leaf(const PrimRef& ref, const Ray& r, Interval ray_t, HitRecord& hit) const {
+      if constexpr (Shape::has(PrimitiveKind::sphere))
+        if (Shape::only(PrimitiveKind::sphere) || ref.kind == PrimitiveKind::sphere)
+          return spheres[ref.index].hit(r, ray_t, hit);
+      if constexpr (Shape::has(PrimitiveKind::quad))
+        if (Shape::only(PrimitiveKind::quad) || ref.kind == PrimitiveKind::quad)
+          return quads[ref.index].hit(r, ray_t, hit);
+      if constexpr (Shape::has(PrimitiveKind::triangle))
+        if (Shape::only(PrimitiveKind::triangle) || ref.kind == PrimitiveKind::triangle)
+          return triangles[ref.index].hit(r, ray_t, hit);
+      if constexpr (Shape::has(PrimitiveKind::other))
+        return others[ref.index]->hit(r, ray_t, hit);
+      return false;
+    }
+
+    // bounding box of a leaf primitive
+    AABB leaf_bounds(const PrimRef& ref) const {
+      switch (ref.kind) {
+        case PrimitiveKind::sphere:   return spheres[ref.index].bounding_box();
+        case PrimitiveKind::quad:     return quads[ref.index].bounding_box();
+        case PrimitiveKind::triangle: return triangles[ref.index].bounding_box();
+        default:                      return others[ref.index]->bounding_box();
+      }
+    }
+
+    // computes the full hit record for the closest leaf primitive
+    template<typename Shape>
+    void finalize_leaf(const PrimRef& ref, const Ray& r, HitRecord& hit) const {
+      hit.object = objects[ref.object].get();
+      hit.material = materials[ref.material];
+      if constexpr (Shape::has(PrimitiveKind::sphere))
+        if (Shape::only(PrimitiveKind::sphere) || ref.kind == PrimitiveKind::sphere)
+          return spheres[ref.index].finalize(r, hit);
+      if constexpr (Shape::has(PrimitiveKind::quad))
+        if (Shape::only(PrimitiveKind::quad) || ref.kind == PrimitiveKind::quad)
+          return quads[ref.index].finalize(r, hit);
+      if constexpr (Shape::has(PrimitiveKind::triangle))
+        if (Shape::only(PrimitiveKind::triangle) || ref.kind == PrimitiveKind::triangle)
+          return triangles[ref.index].finalize(r, hit);
+      if constexpr (Shape::has(PrimitiveKind::other))
+        others[ref.index]->finalize(r, hit);
+    }
+
+    // bounds of the light of a light source.
+    // Quads and triangles emit on the side of their normal, spheres on all sides, and boxes and
+    // meshes in the cone of the normals of their faces
+    static LightBounds light_bounds(const Light& light) {
+      const Primitive& object = *light.object;
+      const Colour& colour = light.material->colour;
+      Real phi = light.material->intensity * (colour.r + colour.g + colour.b) / 3 * object.area;
+      LightBounds bounds(object.bounding_box(), phi, Vec(0, 0, 1), -1, 0);
+      switch (object.kind) {
+        case PrimitiveKind::quad:
+        case PrimitiveKind::triangle:
+          bounds.w = static_cast<const Primitive2D&>(object).normal;
+          bounds.cos_theta_o = 1;
+          break;
+        case PrimitiveKind::box:
+          normals_cone(static_cast<const Box&>(object).get_faces(), bounds);
+          break;
+        case PrimitiveKind::mesh:
+          normals_cone(static_cast<const Mesh&>(object).get_triangles(), bounds);
+          break;
+        default:
+          break;
+      }
+      return bounds;
+    }
+
+    // sets the cone of the light bounds to the cone of the normals of a list of 2D primitives,
+    // around their area weighted mean. The cone is the whole sphere if the mean is zero
+    static void normals_cone(const HittableList& faces, LightBounds& bounds) {
+      Vec sum(0);
+      for (const auto& face : faces.objects)
+        sum += static_cast<const Primitive2D&>(*face).normal * face->area;
+      if (vec::length_squared(sum) <= NEAR_ZERO*NEAR_ZERO)
+        return;
+
+      bounds.w = vec::normalize(sum);
+      bounds.cos_theta_o = 1;
+      for (const auto& face : faces.objects)
+        bounds.cos_theta_o = std::min(bounds.cos_theta_o, vec::dot(bounds.w, static_cast<const Primitive2D&>(*face).normal));
+    }
+
+    // adds a leaf primitive of the scene object with the given index
+    void add_leaf(const Primitive& leaf, int object, int material) {
+      PrimRef ref{leaf.kind, 0, object, material};
+      switch (leaf.kind) {
+        case PrimitiveKind::sphere:
+          ref.index = (int)spheres.size();
+          spheres.push_back(static_cast<const Sphere&>(leaf));
+          break;
+        case PrimitiveKind::quad:
+          ref.index = (int)quads.size();
+          quads.push_back(static_cast<const Quad&>(leaf));
+          break;
+        case PrimitiveKind::triangle:
+          ref.index = (int)triangles.size();
+          triangles.push_back(static_cast<const Triangle&>(leaf));
+          break;
+        default:
+          ref.kind = PrimitiveKind::other;
+          ref.index = (int)others.size();
+          others.push_back(&leaf);
+          break;
+      }
+      refs.push_back(ref);
+      primitive_kinds |= kind_bit(ref.kind);
+    }
+};
+
+
+// Freezes the scene graph into flat arrays, a material table, a light table and a BVH.
+// The leaves are copied sequentially, their bounds and the BVH are computed in parallel.
+inline CompiledScene Scene::compile() const {
+  CompiledScene compiled;
+  compiled.ambient_light = ambient_light;
+  compiled.background = background;
+
+  // reserve the leaf arrays
+  size_t nspheres = 0, nquads = 0, ntriangles = 0, nothers = 0;
+  for (const auto& object : primitives.objects) {
+    switch (object->kind) {
+      case PrimitiveKind::sphere:   nspheres++; break;
+      case PrimitiveKind::quad:     nquads++; break;
+      case PrimitiveKind::triangle: ntriangles++; break;
+      case PrimitiveKind::box:      nquads += static_cast<const Box&>(*object).get_faces().objects.size(); break;
+      case PrimitiveKind::mesh:     ntriangles += static_cast<const Mesh&>(*object).get_triangles().objects.size(); break;
+      default:                      nothers++; break;
+    }
+  }
+  compiled.spheres.reserve(nspheres);
+  compiled.quads.reserve(nquads);
+  compiled.triangles.reserve(ntriangles);
+  compiled.others.reserve(nothers);
+  compiled.refs.reserve(nspheres + nquads + ntriangles + nothers);
+  compiled.objects.reserve(primitives.objects.size());
+
+  std::map<const Material*, int> material_ids;
+  const Material* last_material = nullptr; // objects often share the material of the previous one
+  int last_material_id = -1;
+  for (const auto& object : primitives.objects) {
+    int object_id = (int)compiled.objects.size();
+    compiled.objects.push_back(object);
+
+    // material table, each material is stored once
+    const Material* mat = object->material.get();
+    if (mat != last_material) {
+      auto it = material_ids.find(mat);
+      if (it == material_ids.end()) {
+        it = material_ids.emplace(mat, (int)compiled.materials.size()).first;
+        compiled.materials.push_back(mat);
+        compiled.material_kinds |= kind_bit(mat->kind);
+      }
+      last_material = mat;
+      last_material_id = it->second;
+    }
+
+    // flatten composite primitives into their leaves
+    if (object->kind == PrimitiveKind::box) {
+      for (const auto& face : static_cast<const Box&>(*object).get_faces().objects)
+        compiled.add_leaf(*face, object_id, last_material_id);
+    } else if (object->kind == PrimitiveKind::mesh) {
+      for (const auto& triangle : static_cast<const Mesh&>(*object).get_triangles().objects)
+        compiled.add_leaf(*triangle, object_id, last_material_id);
+    } else {
+      compiled.add_leaf(*object, object_id, last_material_id);
+    }
+
+    // light table
+    if (object->emitter) {
+      compiled.light_ids[object.get()] = (int)compiled.lights.size();
+      compiled.lights.push_back(Light{object.get(), static_cast<const LightMat*>(mat)});
+    }
+  }
+
+  // light hierarchy
+  std::vector<LightBounds> light_bounds(compiled.lights.size());
+  for (size_t i = 0; i < light_bounds.size(); i++)
+    light_bounds[i] = CompiledScene::light_bounds(compiled.lights[i]);
+  compiled.light_bvh = LightBVH(light_bounds);
+
+  // bounds of the leaves
+  int nleaves = (int)compiled.refs.size();
+  std::vector<AABB> bounds(nleaves);
+#ifdef OPENMP
+  #pragma omp parallel for
+#endif
+  for (int i = 0; i < nleaves; i++)
+    bounds[i] = compiled.leaf_bounds(compiled.refs[i]);
+
+  // build the BVH and store the leaf references in leaf order
+  compiled.bvh = BVH(bounds);
+  std::vector<CompiledScene::PrimRef> ordered(compiled.refs.size());
+  for (size_t i = 0; i < ordered.size(); i++)
+    ordered[i] = compiled.refs[compiled.bvh.items[i]];
+  compiled.refs.swap(ordered);
+
+  std::clog << "Compiled scene: " << compiled.objects.size() << " objects, "
+            << compiled.refs.size() << " leaf primitives, "
+            << compiled.materials.size() << " materials, "
+            << compiled.lights.size() << " lights, "
+            << compiled.bvh.nodes.size() << " BVH nodes" << std::endl;
+  return compiled;
+}
+
+} // namespace raytracer
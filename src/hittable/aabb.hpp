@@ -0,0 +1,72 @@
+#pragma once
+
+#include "../utils/common.hpp"
+#include "../utils/interval.hpp"
+#include "../utils/vec.hpp"
+#include "../ray.hpp"
+
+namespace raytracer {
+
+// An axis-aligned bounding box, defined by its min and max corners.
+class AABB {
+  public:
+    Point min, max;
+
+    // empty box, expanding it with any point gives a box containing only that point
+    AABB() : min(infinity), max(-infinity) {}
+
+    // box with opposite corners a and b, padded so that no side is thinner than delta
+    AABB(const Point& a, const Point& b, Real delta = 0.0001)
+      : min(vec::min(a, b)), max(vec::max(a, b)) {
+      Vec pad = vec::max(Vec(delta) - (max - min), Vec(0)) / Real(2);
+      min -= pad;
+      max += pad;
+    }
+
+    void expand(const Point& p) {
+      min = vec::min(min, p);
+      max = vec::max(max, p);
+    }
+
+    void expand(const AABB& box) {
+      min = vec::min(min, box.min);
+      max = vec::max(max, box.max);
+    }
+
+    Point centroid() const {
+      return Real(0.5) * (min + max);
+    }
+
+    // surface area of the box, used by the SAH cost
+    Real surface_area() const {
+      Vec d = max - min;
+      if (d.x < 0 || d.y < 0 || d.z < 0) return 0;
+      return 2 * (d.x*d.y + d.y*d.z + d.z*d.x);
+    }
+
+    // index of the longest axis of the box (0 = x, 1 = y, 2 = z)
+    int longest_axis() const {
+      Vec d = max - min;
+      if (d.x > d.y && d.x > d.z) return 0;
+      return (d.y > d.z) ? 1 : 2;
+    }
+
+    // Slab test: true if the ray intersects the box within ray_t.
+    // inv_dir is the component-wise inverse of the ray direction, precomputed by the caller.
+    // The comparisons are written so that NaNs (0 * infinity) never reject a hit.
+    bool hit(const Ray& r, const Vec& inv_dir, Interval ray_t) const {
+      const Point& o = r.origin();
+      for (int axis = 0; axis < 3; axis++) {
+        Real t0 = (min[axis] - o[axis]) * inv_dir[axis];
+        Real t1 = (max[axis] - o[axis]) * inv_dir[axis];
+        if (inv_dir[axis] < 0) std::swap(t0, t1);
+        ray_t.min = t0 > ray_t.min ? t0 : ray_t.min;
+        ray_t.max = t1 < ray_t.max ? t1 : ray_t.max;
+        if (ray_t.max < ray_t.min)
+          return false;
+      }
+      return true;
+    }
+};
+
+} // namespace raytracer
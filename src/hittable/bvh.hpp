@@ -0,0 +1,212 @@
+#pragma once
+
+#include "../utils/common.hpp"
+#include "../utils/interval.hpp"
+#include "../ray.hpp"
+#include "aabb.hpp"
+
+namespace raytracer {
+
+// A Bounding Volume Hierarchy over a list of items given by their bounding boxes.
+// The tree is built with a binned Surface Area Heuristic (SAH) and stored as a flat
+// array of nodes in depth-first order. The BVH only stores item indices: the owner
+// of the items reorders them in leaf order (see `items`) and intersects them itself.
+// With OPENMP, the subtrees of large nodes are built in parallel tasks.
+class BVH {
+  public:
+    // A node of the flattened tree.
+    // Interior nodes: the left child is the next node, `offset` is the right child
+    // and `axis` is the split axis, used to visit the nearest child first.
+    // Leaves: `offset` is the position of the first item and `count` > 0 the number of items.
+    class Node {
+      public:
+        AABB bbox;
+        int offset;
+        int count;
+        int axis;
+    };
+
+    std::vector<Node> nodes; // tree nodes, the root is nodes[0]
+    std::vector<int> items;  // indices of the items in leaf order
+
+    BVH() = default;
+
+    // builds the tree over the items with the given bounding boxes
+    explicit BVH(const std::vector<AABB>& bounds, int _max_leaf_size = 4)
+      : max_leaf_size(_max_leaf_size) {
+      int n = (int)bounds.size();
+      if (n == 0) return;
+
+      items.resize(n);
+      centroids.resize(n);
+      for (int i = 0; i < n; i++) {
+        items[i] = i;
+        centroids[i] = bounds[i].centroid();
+      }
+      nodes.reserve(2*n);
+    #ifdef OPENMP
+      #pragma omp parallel
+      #pragma omp single
+    #endif
+      build(bounds, 0, n, 0, nodes);
+      nodes.shrink_to_fit();
+      centroids.clear();
+      centroids.shrink_to_fit();
+    }
+
+    // Traverses the tree, nearest child first, calling intersect(i, ray_t) for each item
+    // in the leaves hit by the ray, where i is the position of the item in leaf order.
+    // intersect must return true on a hit and shrink ray_t.max to the hit distance.
+    // Returns true if any item was hit.
+    template<typename Func>
+    bool traverse(const Ray& r, Interval ray_t, Func&& intersect) const {
+      if (nodes.empty()) return false;
+
+      Vec inv_dir = Real(1) / r.direction();
+      bool dir_neg[3] = {inv_dir.x < 0, inv_dir.y < 0, inv_dir.z < 0};
+
+      bool hit_anything = false;
+      int stack[MAX_DEPTH]; // nodes to visit, at most one per level of the tree
+      int stack_size = 0;
+      int current = 0;
+      while (true) {
+        const Node& node = nodes[current];
+        if (node.bbox.hit(r, inv_dir, ray_t)) {
+          if (node.count > 0) {
+            // leaf: intersect its items
+            for (int i = node.offset; i < node.offset + node.count; i++)
+              hit_anything |= intersect(i, ray_t);
+            if (stack_size == 0) break;
+            current = stack[--stack_size];
+          } else if (dir_neg[node.axis]) {
+            // interior: visit the nearest child first
+            stack[stack_size++] = current + 1;
+            current = node.offset;
+          } else {
+            stack[stack_size++] = node.offset;
+            current = current + 1;
+          }
+        } else {
+          if (stack_size == 0) break;
+          current = stack[--stack_size];
+        }
+      }
+      return hit_anything;
+    }
+
+    // memory used by the tree, in bytes
+    size_t memory_usage() const {
+      return nodes.capacity()*sizeof(Node) + items.capacity()*sizeof(int);
+    }
+
+  private:
+    static const int NBINS = 12;     // number of bins used to evaluate the SAH
+    static const int MAX_DEPTH = 64; // maximum depth of the tree, deeper nodes become leaves
+    static const int PARALLEL_BUILD_SIZE = 16384; // minimum number of items of a node whose children are built in parallel
+
+    int max_leaf_size = 4;        // maximum number of items in a leaf
+    std::vector<Point> centroids; // centroids of the items bounds, only used while building
+
+    // builds the subtree over items[begin, end) at the end of out and returns the index of its root node
+    int build(const std::vector<AABB>& bounds, int begin, int end, int depth, std::vector<Node>& out) {
+      int index = (int)out.size();
+      out.push_back(Node());
+
+      AABB bbox, centroid_bbox;
+      for (int i = begin; i < end; i++) {
+        bbox.expand(bounds[items[i]]);
+        centroid_bbox.expand(centroids[items[i]]);
+      }
+
+      int count = end - begin;
+      int axis = centroid_bbox.longest_axis();
+      Real cmin = centroid_bbox.min[axis];
+      Real extent = centroid_bbox.max[axis] - cmin;
+
+      // small node, all centroids at the same point or maximum depth: make a leaf
+      if (count <= max_leaf_size || extent <= 0 || depth == MAX_DEPTH - 1) {
+        out[index] = Node{bbox, begin, count, 0};
+        return index;
+      }
+
+      // bin the items by centroid along the split axis
+      auto bin_of = [&](int item) {
+        int b = (int)(NBINS * (centroids[item][axis] - cmin) / extent);
+        return std::min(b, NBINS - 1);
+      };
+      AABB bin_bbox[NBINS];
+      int bin_count[NBINS] = {0};
+      for (int i = begin; i < end; i++) {
+        int b = bin_of(items[i]);
+        bin_bbox[b].expand(bounds[items[i]]);
+        bin_count[b]++;
+      }
+
+      // SAH cost of splitting after each bin: area(left)*count(left) + area(right)*count(right)
+      Real right_cost[NBINS];
+      AABB right_bbox;
+      int right_count = 0;
+      for (int b = NBINS - 1; b > 0; b--) {
+        right_bbox.expand(bin_bbox[b]);
+        right_count += bin_count[b];
+        right_cost[b] = right_count * right_bbox.surface_area();
+      }
+      int best_split = -1;
+      Real best_cost = infinity;
+      AABB left_bbox;
+      int left_count = 0;
+      for (int b = 0; b < NBINS - 1; b++) {
+        left_bbox.expand(bin_bbox[b]);
+        left_count += bin_count[b];
+        Real cost = left_count * left_bbox.surface_area() + right_cost[b+1];
+        if (left_count > 0 && left_count < count && cost < best_cost) {
+          best_cost = cost;
+          best_split = b;
+        }
+      }
+
+      // partition the items, falling back to a median split if the SAH found no split
+      int mid;
+      if (best_split >= 0) {
+        mid = (int)(std::partition(items.begin() + begin, items.begin() + end,
+          [&](int item) { return bin_of(item) <= best_split; }) - items.begin());
+      } else {
+        mid = (begin + end) / 2;
+        std::nth_element(items.begin() + begin, items.begin() + mid, items.begin() + end,
+          [&](int a, int b) { return centroids[a][axis] < centroids[b][axis]; });
+      }
+
+    #ifdef OPENMP
+      if (count >= PARALLEL_BUILD_SIZE) {
+        // the children partition disjoint item ranges: build them in separate node arrays
+        // and append them in depth-first order, the left child right after this node
+        std::vector<Node> left_nodes, right_nodes;
+        #pragma omp task shared(bounds, left_nodes)
+        build(bounds, begin, mid, depth + 1, left_nodes);
+        #pragma omp task shared(bounds, right_nodes)
+        build(bounds, mid, end, depth + 1, right_nodes);
+        #pragma omp taskwait
+        append(left_nodes, out);
+        int right = append(right_nodes, out);
+        out[index] = Node{bbox, right, 0, axis};
+        return index;
+      }
+    #endif
+      build(bounds, begin, mid, depth + 1, out);
+      int right = build(bounds, mid, end, depth + 1, out);
+      out[index] = Node{bbox, right, 0, axis};
+      return index;
+    }
+
+    // appends a subtree built in its own array to out, and returns the index of its root node
+    static int append(const std::vector<Node>& subtree, std::vector<Node>& out) {
+      int base = (int)out.size();
+      for (Node node : subtree) {
+        if (node.count == 0) node.offset += base; // right child of an interior node, leaves keep their item position
+        out.push_back(node);
+      }
+      return base;
+    }
+};
+
+} // namespace raytracer
@@ -1,19 +1,26 @@
 #pragma once
 
 #include "../utils/common.hpp"
+#include "../utils/vec.hpp"
 #include "../ray.hpp"
 
 namespace raytracer {
 
 // Forward declarations to avoid circular dependencies.
 class Primitive;
+class Material;
 
 // The HitRecord class stores information about a ray-object intersection.
+// Intersection tests only record t, prim_id and the surface coordinates (u, v).
+// The hit point and normal are computed once for the closest hit by Primitive::finalize.
 class HitRecord {
   public:
+    Real t;                              // ray parametrized distance at hit point
+    const Primitive* object = nullptr;   // object that was hit, owned by the scene
+    const Material* material = nullptr;  // material at the hit point, owned by the scene
+    int prim_id = -1;                    // index of the hit part of a composite object (box face, mesh triangle)
+    Real u, v;                           // surface coordinates of the hit point (barycentrics for triangles)
     Point p;                             // hit point
-    shared_ptr<const Primitive> object;  // object that was hit
-    double t;                            // ray parametrized distance at hit point
 
     // getters
     Vec normal() const { return m_normal; }
@@ -22,10 +29,16 @@ class HitRecord {
     // Sets the hit record normal vector and face orientation
     // NOTE: the parameter `outward_normal` is assumed to be normalized
     void set_normal(const Ray& ray, const Vec& outward_normal) {
-      m_front_face = glm::dot(ray.direction(), outward_normal) < 0;
+      m_front_face = vec::dot(ray.direction(), outward_normal) < 0;
       m_normal = m_front_face ? outward_normal : -outward_normal;
     }
 
+    // returns a ray leaving the hit point in the given direction,
+    // with its origin offset so that it does not hit this surface again
+    Ray spawn_ray(const Vec& direction) const {
+      return Ray(vec::offset_ray_origin(p, m_normal, direction), direction);
+    }
+
   private:
     Vec m_normal;                          // normal vector at the hit point, normalized
     bool m_front_face;                     // true if the ray hit the front face of the object
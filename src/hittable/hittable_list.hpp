@@ -23,20 +23,32 @@ class HittableList : public Hittable {
       objects.push_back(object);
     }
 
+    // find the closest hit and finalize the hit record for it
     bool hit(const Ray& r, Interval ray_t, HitRecord& hit) const override {
-      HitRecord temp_hit;
-      bool hit_anything = false;
-      double closest_so_far = ray_t.max;
-
-      for (const auto& object : objects) {
-        if (object->hit(r, Interval(ray_t.min, closest_so_far), temp_hit)) {
-          hit_anything = true;
-          closest_so_far = temp_hit.t;
-          hit = temp_hit;
+      int closest = closest_hit(r, ray_t, hit);
+      if (closest < 0)
+        return false;
+
+      hit.object = objects[closest].get();
+      hit.material = hit.object->material.get();
+      hit.object->finalize(r, hit);
+      return true;
+    }
+
+    // returns the index of the closest hit object, or -1 if nothing was hit.
+    // only the intersection fields of the hit record (t, prim_id, u, v) are updated,
+    // the hit record must be finalized by the caller.
+    // T is the static type used to call hit(), for lists known to hold a single type.
+    template<typename T = Primitive>
+    int closest_hit(const Ray& r, Interval ray_t, HitRecord& hit) const {
+      int closest = -1;
+      for (int i = 0; i < (int)objects.size(); i++) {
+        if (static_cast<const T&>(*objects[i]).hit(r, ray_t, hit)) {
+          closest = i;
+          ray_t.max = hit.t;
         }
       }
-
-      return hit_anything;
+      return closest;
     }
 };
 
@@ -0,0 +1,64 @@
+#pragma once
+
+#include "utils/common.hpp"
+
+// Compile-time configuration of the path tracing integrator.
+namespace raytracer::integrator {
+
+
+// The features of an integrator kernel, fixed at compile time so that the
+// disabled features leave no branches in the path tracing loop.
+template<bool RR, bool NEE, bool MIS, int MaxDepth>
+class Policy {
+  public:
+    static constexpr bool russian_roulette = RR; // russian roulette path termination
+    static constexpr bool nee = NEE;             // next event estimation: a shadow ray to a light at each bounce
+    static constexpr bool mis = MIS;             // multiple importance sampling of lights and BSDFs
+    static constexpr int max_depth = MaxDepth;   // maximum number of bounces, 0 if only known at runtime
+};
+
+// Power heuristic (beta = 2) weight of a sample drawn with density pdf_a, when the same
+// direction could also have been drawn by a strategy with density pdf_b (Veach 1997).
+inline Real power_heuristic(Real pdf_a, Real pdf_b) {
+  Real a = pdf_a*pdf_a, b = pdf_b*pdf_b;
+  return a / (a + b);
+}
+
+// maximum depths with a kernel of their own, other depths use the runtime value
+using StaticDepths = std::integer_sequence<int, 5, 10, 15, 20>;
+
+
+// calls func with the policy of maximum depth max_depth, or of runtime depth if it has no kernel
+template<bool RR, bool NEE, bool MIS, typename Func, int... Depths>
+inline void select_depth(int max_depth, Func& func, std::integer_sequence<int, Depths...>) {
+  bool found = ((max_depth == Depths && (func(Policy<RR, NEE, MIS, Depths>()), true)) || ...);
+  if (!found)
+    func(Policy<RR, NEE, MIS, 0>());
+}
+
+// Calls func(policy) once, with the policy that matches the runtime settings.
+// Each combination of settings is a different instantiation of func.
+// MIS weighs the light samples of next event estimation, it is ignored without it.
+template<typename Func>
+inline void select(bool rr, bool nee, bool mis, int max_depth, Func&& func) {
+  mis = nee && mis;
+  auto branch = [](bool flag, auto&& next) {
+    if (flag) next(std::true_type());
+    else next(std::false_type());
+  };
+  branch(rr, [&](auto RR) {
+    constexpr bool russian_roulette = decltype(RR)::value;
+    branch(nee, [&](auto NEE) {
+      if constexpr (decltype(NEE)::value) {
+        branch(mis, [&](auto MIS) {
+          select_depth<russian_roulette, true, decltype(MIS)::value>(max_depth, func, StaticDepths());
+        });
+      } else {
+        select_depth<russian_roulette, false, false>(max_depth, func, StaticDepths());
+      }
+    });
+  });
+}
+
+
+} // namespace raytracer::integrator
@@ -0,0 +1,274 @@
+#pragma once
+
+#include "utils/common.hpp"
+#include "utils/vec.hpp"
+#include "hittable/aabb.hpp"
+#include "hittable/bvh.hpp"
+
+namespace raytracer {
+
+
+// Bounds of the light emitted by a light source or by a group of them (PBRT 4th ed., 12.6.3):
+// where it is emitted from, how much, and in which directions. The emitting surface normals
+// are within theta_o of the axis w, and each point emits up to theta_e away from its normal.
+class LightBounds {
+  public:
+    AABB bounds;            // bounds of the emitting surfaces
+    Real phi = 0;           // emitted power, up to a constant factor
+    Vec w = Vec(0, 0, 1);   // axis of the cone of the surface normals, normalized
+    Real cos_theta_o = -1;  // cosine of the spread of the normals around w
+    Real cos_theta_e = 0;   // cosine of the spread of the emission around each normal
+
+    LightBounds() = default;
+    LightBounds(const AABB& _bounds, Real _phi, const Vec& _w, Real _cos_theta_o, Real _cos_theta_e)
+      : bounds(_bounds), phi(_phi), w(_w), cos_theta_o(_cos_theta_o), cos_theta_e(_cos_theta_e) {}
+
+    // Conservative estimate of the light arriving at the point p, whose surface only receives
+    // light from the hemisphere of the normal n: the power over the squared distance, times the
+    // largest cosines that the emitting surfaces and the receiving surface can make with each other.
+    // Zero if no light can reach p.
+    Real importance(const Point& p, const Vec& n) const {
+      if (phi <= 0)
+        return 0;
+
+      // squared distance to the center of the bounds, and squared radius of their bounding sphere
+      Point center = bounds.centroid();
+      Real d2 = vec::length_squared(p - center);
+      Real r2 = vec::length_squared(bounds.max - bounds.min) / 4;
+
+      // inside the bounding sphere, the emitters can be in any direction
+      if (d2 <= r2)
+        return phi / r2;
+
+      // angle theta_b of the bounding sphere seen from p
+      Real inv_d2 = 1 / d2;
+      Real sin2_theta_b = r2 * inv_d2;
+      Real cos_theta_b = std::sqrt(1 - sin2_theta_b);
+      Real sin_theta_b = std::sqrt(sin2_theta_b);
+
+      // smallest angle between the normals and the direction to p: theta_w - theta_o - theta_b
+      Vec wi = (p - center) * std::sqrt(inv_d2);
+      Real cos_theta_x = cos_sub_clamped(vec::dot(w, wi), sin_theta_o(), cos_theta_o);
+      Real cos_theta_p = cos_sub_clamped(cos_theta_x, sin_theta_b, cos_theta_b);
+      if (cos_theta_p <= cos_theta_e)
+        return 0;
+
+      // smallest angle between n and the directions to the emitters: theta_i - theta_b
+      Real cos_theta_pi = cos_sub_clamped(-vec::dot(n, wi), sin_theta_b, cos_theta_b);
+      if (cos_theta_pi <= 0)
+        return 0;
+
+      return phi * cos_theta_p * cos_theta_pi * inv_d2;
+    }
+
+    // bounds of the light of both a and b
+    static LightBounds merge(const LightBounds& a, const LightBounds& b) {
+      if (a.phi <= 0) return b;
+      if (b.phi <= 0) return a;
+
+      LightBounds merged = a;
+      merged.bounds.expand(b.bounds);
+      merged.phi = a.phi + b.phi;
+      merged.cos_theta_e = std::min(a.cos_theta_e, b.cos_theta_e);
+      merge_cones(a.w, a.cos_theta_o, b.w, b.cos_theta_o, merged.w, merged.cos_theta_o);
+      return merged;
+    }
+
+  private:
+    Real sin_theta_o() const {
+      return std::sqrt(std::max(1 - cos_theta_o*cos_theta_o, Real(0)));
+    }
+
+    // cos(max(0, a - b)) for the angles a and b in [0, pi], given their cosines and the sine of b.
+    // The sine of a is only computed if a > b
+    static Real cos_sub_clamped(Real cos_a, Real sin_b, Real cos_b) {
+      if (cos_a > cos_b) return 1;
+      Real sin_a = std::sqrt(std::max(1 - cos_a*cos_a, Real(0)));
+      return cos_a*cos_b + sin_a*sin_b;
+    }
+
+    // smallest cone (w, cos_theta) that contains the cones (wa, cos_a) and (wb, cos_b)
+    static void merge_cones(const Vec& wa, Real cos_a, const Vec& wb, Real cos_b, Vec& w, Real& cos_theta) {
+      Real theta_a = std::acos(std::clamp(cos_a, Real(-1), Real(1)));
+      Real theta_b = std::acos(std::clamp(cos_b, Real(-1), Real(1)));
+      Real theta_d = vec::angle_between(wa, wb);
+
+      // one of the cones contains the other
+      if (std::min(theta_d + theta_b, Real(M_PI)) <= theta_a) { w = wa; cos_theta = cos_a; return; }
+      if (std::min(theta_d + theta_a, Real(M_PI)) <= theta_b) { w = wb; cos_theta = cos_b; return; }
+
+      // the merged cone spans from the far side of a to the far side of b
+      Real theta_o = (theta_a + theta_d + theta_b) / 2;
+      Vec axis = vec::cross(wa, wb);
+      if (theta_o >= Real(M_PI) || vec::length_squared(axis) == 0) {
+        w = wa;
+        cos_theta = -1;
+        return;
+      }
+
+      // rotate wa by theta_o - theta_a towards wb (Rodrigues' rotation formula)
+      axis = vec::normalize(axis);
+      Real theta_r = theta_o - theta_a;
+      w = wa*std::cos(theta_r) + vec::cross(axis, wa)*std::sin(theta_r);
+      w = vec::normalize(w);
+      cos_theta = std::cos(theta_o);
+    }
+};
+
+
+// A hierarchy of light sources, that picks a light in O(log N) with a probability roughly
+// proportional to the light it sends to a given point (PBRT 4th ed., 12.6.3).
+// The tree is the binned SAH BVH of the light bounds, each node storing the LightBounds
+// of its lights. Each interior node picks one of its children in proportion of their
+// importance, and each leaf one of its lights.
+class LightBVH {
+  public:
+    LightBVH() = default;
+
+    // builds the hierarchy over the lights with the given bounds
+    explicit LightBVH(const std::vector<LightBounds>& _lights) : lights(_lights) {
+      std::vector<AABB> bounds(lights.size());
+      for (size_t i = 0; i < lights.size(); i++)
+        bounds[i] = lights[i].bounds;
+      bvh = BVH(bounds, 1);
+      if (bvh.nodes.empty())
+        return;
+
+      nodes.resize(bvh.nodes.size());
+      trails.resize(lights.size());
+      build(0, 0, 0);
+    }
+
+    // Picks a light for the point p of normal n with the random number u in [0,1).
+    // Returns the index of the light and sets probability, or returns -1 if no light reaches p.
+    int sample(const Point& p, const Vec& n, Real u, Real& probability) const {
+      probability = 0;
+      if (nodes.empty())
+        return -1;
+
+      Real pmf = 1;
+      int current = 0;
+      while (bvh.nodes[current].count == 0) {
+        // interior: pick a child, and rescale u in [0,1) for the next choice
+        int right = bvh.nodes[current].offset;
+        Real left_importance = nodes[current + 1].importance(p, n);
+        Real right_importance = nodes[right].importance(p, n);
+        Real total = left_importance + right_importance;
+        if (total <= 0)
+          return -1;
+
+        Real p_left = left_importance / total;
+        if (u < p_left) {
+          current = current + 1;
+          u = std::min(u / p_left, ONE_MINUS_EPSILON);
+          pmf *= p_left;
+        } else {
+          current = right;
+          u = std::min((u - p_left) / (1 - p_left), ONE_MINUS_EPSILON);
+          pmf *= 1 - p_left;
+        }
+      }
+
+      // leaf: pick one of its lights. The importance of a leaf reached from its parent is positive,
+      // and it is the importance of its light if it has only one
+      const BVH::Node& leaf = bvh.nodes[current];
+      if (leaf.count == 1) {
+        if (current == 0 && nodes[0].importance(p, n) <= 0)
+          return -1;
+        probability = pmf;
+        return bvh.items[leaf.offset];
+      }
+      Real total = 0;
+      for (int i = leaf.offset; i < leaf.offset + leaf.count; i++)
+        total += lights[bvh.items[i]].importance(p, n);
+      if (total <= 0)
+        return -1;
+
+      Real target = u * total;
+      int last = -1;
+      for (int i = leaf.offset; i < leaf.offset + leaf.count; i++) {
+        Real importance = lights[bvh.items[i]].importance(p, n);
+        if (importance <= 0)
+          continue;
+        last = i;
+        if (target < importance)
+          break;
+        target -= importance;
+      }
+      probability = pmf * lights[bvh.items[last]].importance(p, n) / total;
+      return bvh.items[last];
+    }
+
+    // probability that sample() picks the given light for the point p of normal n
+    Real probability(const Point& p, const Vec& n, int light) const {
+      if (nodes.empty())
+        return 0;
+
+      // follow the path from the root to the leaf of the light
+      Real pmf = 1;
+      uint64_t trail = trails[light];
+      int current = 0;
+      while (bvh.nodes[current].count == 0) {
+        int right = bvh.nodes[current].offset;
+        Real left_importance = nodes[current + 1].importance(p, n);
+        Real right_importance = nodes[right].importance(p, n);
+        Real total = left_importance + right_importance;
+        if (total <= 0)
+          return 0;
+
+        if (trail & 1) {
+          current = right;
+          pmf *= right_importance / total;
+        } else {
+          current = current + 1;
+          pmf *= left_importance / total;
+        }
+        trail >>= 1;
+      }
+
+      const BVH::Node& leaf = bvh.nodes[current];
+      if (leaf.count == 1)
+        return (current > 0 || nodes[0].importance(p, n) > 0) ? pmf : 0;
+      Real total = 0;
+      for (int i = leaf.offset; i < leaf.offset + leaf.count; i++)
+        total += lights[bvh.items[i]].importance(p, n);
+      if (total <= 0)
+        return 0;
+      return pmf * lights[light].importance(p, n) / total;
+    }
+
+    // memory used by the hierarchy, in bytes
+    size_t memory_usage() const {
+      return bvh.memory_usage() + nodes.capacity()*sizeof(LightBounds)
+           + lights.capacity()*sizeof(LightBounds) + trails.capacity()*sizeof(uint64_t);
+    }
+
+  private:
+    static constexpr Real ONE_MINUS_EPSILON = Real(1) - std::numeric_limits<Real>::epsilon();
+
+    BVH bvh;                          // topology of the tree, and the lights in leaf order
+    std::vector<LightBounds> nodes;   // bounds of the lights of each node of the tree
+    std::vector<LightBounds> lights;  // bounds of each light
+    std::vector<uint64_t> trails;     // path from the root to the leaf of each light, one bit per level (1 = right)
+
+    // computes the bounds of the subtree at the given node, and the trails of its lights
+    LightBounds build(int current, uint64_t trail, int depth) {
+      const BVH::Node& node = bvh.nodes[current];
+      LightBounds bounds;
+      if (node.count > 0) {
+        for (int i = node.offset; i < node.offset + node.count; i++) {
+          bounds = LightBounds::merge(bounds, lights[bvh.items[i]]);
+          trails[bvh.items[i]] = trail;
+        }
+      } else {
+        LightBounds left = build(current + 1, trail, depth + 1);
+        LightBounds right = build(node.offset, trail | (uint64_t(1) << depth), depth + 1);
+        bounds = LightBounds::merge(left, right);
+      }
+      nodes[current] = bounds;
+      return bounds;
+    }
+};
+
+
+} // namespace raytracer
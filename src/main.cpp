@@ -61,8 +61,8 @@ void cornell_box(bool use_phong) {
   Scene scene;
   scene.background = Colour(0.1);
 
-  // light in the middle
-  auto mlight = make_shared<LightMat>(Colour(1), 3);
+  // light in the middle, Phong shading has no distance falloff so path tracing needs a brighter light
+  auto mlight = make_shared<LightMat>(Colour(1), use_phong ? 3 : 40);
   scene.add(make_shared<Quad>(Point(343, 554, 332), Vec(-130,0,0), Vec(0,0,-105), mlight));
   // scene.add(make_shared<Sphere>(Point(278, 554, 278), 40, mlight));
 
@@ -138,7 +138,7 @@ void quads(bool use_phong) {
 
   // light
   scene.ambient_light = Colour(0.1);
-  auto material_light = make_shared<LightMat>(Colour(1), 1.5);
+  auto material_light = make_shared<LightMat>(Colour(1), use_phong ? 1.5 : 200); // brighter for path tracing, see cornell_box()
   scene.add(make_shared<Sphere>(Point(1, 2, 0), 0.2, material_light));
 
   shared_ptr<Material> left_red, back_green, upper_orange, lower_cyan, blue_metal;
@@ -232,9 +232,13 @@ void bunny() {
   scene.add(make_shared<Sphere>(Point(-0.05, 0.15, 0.2), 0.01, material_light));
   // scene.add(make_shared<Sphere>(Point(-0.05, 0.15, -0.2), 0.01, material_light));
 
-  // bunny
+  // bunny, welded and reordered along a Morton curve for memory locality
+  MeshOptions options;
+  options.weld = true;
+  options.remove_degenerate = true;
+  options.reorder = true;
   auto bunny_material = make_shared<Phong>(Colour(0.5), 500);
-  auto bunny = make_shared<raytracer::Mesh>("assets/bunny.obj", bunny_material);
+  auto bunny = make_shared<raytracer::Mesh>("assets/bunny.obj", bunny_material, options);
   scene.add(bunny);
 
   // ground
@@ -300,6 +304,52 @@ void spheres_and_mirror() {
 }
 
 
+// a procedural scene with n small spheres on a grid, 1% of them are lights.
+// the objects are built in batches and moved into the scene.
+void many_spheres(int n) {
+  Scene scene;
+  scene.ambient_light = Colour(0.1);
+
+  random::Sampler sampler;
+
+  // materials
+  std::vector<shared_ptr<Material>> palette;
+  for (int i = 0; i < 16; i++)
+    palette.push_back(make_shared<Diffuse>(random::vec(sampler, 0.2, 1)));
+  auto material_light = make_shared<LightMat>(Colour(1, 0.9, 0.7), 1);
+
+  // spheres in a square grid on the xz plane, with random heights
+  int side = static_cast<int>(std::ceil(std::sqrt(n)));
+  Real spacing = 100.0 / side;
+  std::vector<shared_ptr<Primitive>> batch;
+  batch.reserve(n);
+  for (int i = 0; i < n; i++) {
+    Point center((i % side) * spacing - 50, random::rand(sampler) * 2, (i / side) * spacing - 100);
+    auto material = (i % 100 == 0) ? material_light : palette[i % palette.size()];
+    batch.push_back(make_shared<Sphere>(center, 0.4 * spacing, material));
+  }
+
+  // build the scene and its render-time representation
+  unique_ptr<Camera> camera;
+  utils::clock([&]() {
+    scene.add(std::move(batch));
+    camera = std::make_unique<Camera>(scene);
+  });
+
+  /////////////////////
+
+  camera->aspect_ratio = 16.0/9.0;
+  camera->image_width = 400;
+  camera->samples_per_pixel = 4;
+  camera->max_depth = 5;
+  camera->vfov = 60.0;
+  camera->look_from = Point(0, 15, 10);
+  camera->look_at = Point(0, 0, -30);
+
+  utils::clock([&camera]() { camera->render(); });
+}
+
+
 int main() {
   switch (11) {
     // phong materials
@@ -312,9 +362,13 @@ int main() {
     case 10: spheres(false); break;
     case 11: cornell_box(false); break;
     case 12: quads(false); break;
+    case 13: many_spheres(1000000); break;
 
     // mixed phong and pathtracing materials (experimental)
     case 20: spheres_and_mirror(); break;
     case 21: spheres(true); break;
   }
+
+  // with TRACK_ALLOCATIONS, fail if the render loop allocated heap memory (make run_alloc)
+  return memory::render_allocations() > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
 }
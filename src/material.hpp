@@ -10,98 +10,128 @@ namespace raytracer {
 
 // Forward declarations to avoid circular dependencies
 class HitRecord;
-class Scene;
+class CompiledScene;
 
 
 // A record that contains the result of evaluating a material at a hit point.
+// Everything is stored by value, so evaluating a material never allocates memory.
 class EvalRecord {
   public:
-    Colour colour;       // evaluated colour of the material at the hit point
-    shared_ptr<Pdf> pdf; // pointer to the pdf to be used to sample a new ray
-    shared_ptr<Ray> ray; // new ray to cast, if pdf is null
+    Colour colour;         // evaluated colour of the material at the hit point
+    PdfRecord pdf;         // pdf to be used to sample a new ray, if any
+    Ray ray;               // new ray to cast, if has_ray is true
+    bool has_ray = false;  // true if the ray bounced in a fixed direction
 
     // constructor with only colour (when ray was absorbed)
     EvalRecord(const Colour& _colour)
-      : colour(_colour), pdf(nullptr), ray(nullptr) {}
+      : colour(_colour) {}
 
-    // constructor with all parameters
-    EvalRecord(const Colour& _colour, shared_ptr<Pdf> _pdf, shared_ptr<Ray> _ray)
-      : colour(_colour), pdf(_pdf), ray(_ray) {}
+    // constructor with a pdf to sample the new ray
+    EvalRecord(const Colour& _colour, const PdfRecord& _pdf)
+      : colour(_colour), pdf(_pdf) {}
+
+    // constructor with a new ray to cast
+    EvalRecord(const Colour& _colour, const Ray& _ray)
+      : colour(_colour), ray(_ray), has_ray(true) {}
 };
 
 
 
+// Cheap type tags for the concrete materials, used instead of RTTI on hot paths.
+enum class MaterialKind { other, light, diffuse, metal, dielectric, phong, phong_mirror };
+
+
 // Abstract class that represents a material that can be applied to objects in the scene.
 class Material {
   public:
+    MaterialKind kind = MaterialKind::other; // concrete type, set by the derived class
+
     Material() = default;
     virtual ~Material() = default;
 
     // Evaluate a material at a hit point, returning the colour of the material,
     // a boolean indicating if a new ray should be cast, the new ray to cast
     // and the probability density function ponderation for the new ray.
-    virtual EvalRecord evaluate(const Scene& scene, const Ray& r_in, const HitRecord& hit) const {
+    virtual EvalRecord evaluate(const CompiledScene& scene, const Ray& r_in, const HitRecord& hit, random::Sampler& sampler) const {
       return EvalRecord(Colour(0));
     }
 
     // Calculate the probability density function ponderation for the new ray
-    virtual double scatter_pdf(const Vec& normal, const Ray& r_out) const {
+    virtual Real scatter_pdf(const Vec& normal, const Ray& r_out) const {
       return 1;
     }
 
     // Bidirectional Reflectance Distribution Function (BRDF) ponderation for the material
-    virtual double brdf_factor() const {
+    virtual Real brdf_factor() const {
       return 1;
     }
+
+    // memory used by the material, in bytes
+    virtual size_t memory_usage() const {
+      return sizeof(Material);
+    }
+
+    // true if the material emits light
+    bool is_emissive() const {
+      return kind == MaterialKind::light;
+    }
 };
 
 
 
 // A material that emits light
-class LightMat : public Material {
+class LightMat final : public Material {
   public:
     Colour colour;    // colour of the light source
-    double intensity; // intensity of the light source, used to calculate radiance
+    Real intensity; // intensity of the light source, used to calculate radiance
 
-    LightMat(const Colour& _colour, double _intensity) : colour(_colour), intensity(_intensity) {}
+    LightMat(const Colour& _colour, Real _intensity) : colour(_colour), intensity(_intensity) {
+      kind = MaterialKind::light;
+    }
 
-    EvalRecord evaluate(const Scene& scene, const Ray& r_in, const HitRecord& hit) const override {
+    EvalRecord evaluate(const CompiledScene& scene, const Ray& r_in, const HitRecord& hit, random::Sampler& sampler) const override {
       return EvalRecord(hit.front_face() ? radiance(0) : Colour(0));
     }
 
     // calculate the radiance of the light at a given distance
-    Colour radiance(double t) const {
+    Colour radiance(Real t) const {
       // return colour * intensity / (t*t); // TODO
       return colour * intensity;
     }
+
+    size_t memory_usage() const override {
+      return sizeof(*this);
+    }
 };
 
 
 
 // A Diffuse (Lambertian) material that bounces rays in random directions
-class Diffuse : public Material {
+class Diffuse final : public Material {
   public:
-    Diffuse(const Colour& _albedo) : albedo(_albedo) {}
+    Diffuse(const Colour& _albedo) : albedo(_albedo) {
+      kind = MaterialKind::diffuse;
+    }
 
-    EvalRecord evaluate(const Scene& scene, const Ray& r_in, const HitRecord& hit) const override {
-      return EvalRecord{
-        albedo,
-        std::make_shared<CosinePdf>(hit.normal()),
-        nullptr,
-      };
+    EvalRecord evaluate(const CompiledScene& scene, const Ray& r_in, const HitRecord& hit, random::Sampler& sampler) const override {
+      return EvalRecord(albedo, PdfRecord::cosine(hit.normal()));
     }
 
     // PDF for the new ray: cosine-weighted in the hemisphere around the normal
-    double scatter_pdf(const Vec& normal, const Ray& r_out) const override {
-      double cos_theta = std::max(glm::dot(normal, r_out.direction()), 0.0);
+    Real scatter_pdf(const Vec& normal, const Ray& r_out) const override {
+      Real cos_theta = std::max(vec::dot(normal, r_out.direction()), Real(0));
       return cos_theta * brdf_factor();
     }
 
     // BRDF for Lambertian material: 1/pi
-    double brdf_factor() const override {
+    Real brdf_factor() const override {
       return M_1_PI;
     }
 
+    size_t memory_usage() const override {
+      return sizeof(*this);
+    }
+
   private:
     Colour albedo; // colour of the material
 };
@@ -110,63 +140,66 @@ class Diffuse : public Material {
 
 // A Metal / Mirror material that reflects rays
 // if fuzz is zero, the reflection is perfect (Mirror)
-class Metal : public Material {
+class Metal final : public Material {
   public:
-    Metal(const Colour& _albedo, double _fuzz)
-     : albedo(_albedo), fuzz(std::min(_fuzz, 1.0)) {}
+    Metal(const Colour& _albedo, Real _fuzz)
+     : albedo(_albedo), fuzz(std::min(_fuzz, Real(1))) {
+      kind = MaterialKind::metal;
+    }
 
-    EvalRecord evaluate(const Scene& scene, const Ray& r_in, const HitRecord& hit) const override {
+    EvalRecord evaluate(const CompiledScene& scene, const Ray& r_in, const HitRecord& hit, random::Sampler& sampler) const override {
       // bounce the ray in a fuzzy direction
-      Vec reflected = glm::reflect(r_in.direction(), hit.normal());
-      reflected = glm::normalize(reflected) + (fuzz*random::sample_sphere_uniform());
-      auto out_ray = make_shared<Ray>(hit.p, reflected);
+      Vec reflected = vec::reflect(r_in.direction(), hit.normal());
+      reflected = vec::normalize(reflected) + (fuzz*random::sample_sphere_uniform(sampler));
+      Ray out_ray = hit.spawn_ray(reflected);
 
-      // absorb rays that bounce below the surface
-      bool bounced = glm::dot(out_ray->direction(), hit.normal()) > 0;
+      // absorb rays that bounce below the surface, they carry no light
+      bool bounced = vec::dot(out_ray.direction(), hit.normal()) > 0;
 
-       // TODO
-      return EvalRecord{
-        albedo,
-        nullptr,
-        bounced ? out_ray : nullptr,
-      };
+      return bounced ? EvalRecord(albedo, out_ray) : EvalRecord(Colour(0));
+    }
+
+    size_t memory_usage() const override {
+      return sizeof(*this);
     }
 
   private:
     Colour albedo; // colour of the material
-    double fuzz;   // zero for a shiny surface, one for a completely random reflection
+    Real fuzz;     // zero for a shiny surface, one for a completely random reflection
 };
 
 
 // A Dielectric (glass) material that refracts rays when possible and reflects them otherwise
-class Dielectric : public Material {
+class Dielectric final : public Material {
   public:
-    Dielectric(double _refract_idx) : refract_idx(_refract_idx) {}
+    Dielectric(Real _refract_idx) : refract_idx(_refract_idx) {
+      kind = MaterialKind::dielectric;
+    }
 
-    EvalRecord evaluate(const Scene& scene, const Ray& r_in, const HitRecord& hit) const override {
-      double ri = hit.front_face() ? (1.0/refract_idx) : refract_idx;
-      double cos_theta = std::min(glm::dot(-r_in.direction(), hit.normal()), 1.0);
-      double sin_theta = std::sqrt(1.0 - cos_theta*cos_theta);
-      bool can_refract = ri * sin_theta <= 1.0;
+    EvalRecord evaluate(const CompiledScene& scene, const Ray& r_in, const HitRecord& hit, random::Sampler& sampler) const override {
+      Real ri = hit.front_face() ? (1/refract_idx) : refract_idx;
+      Real cos_theta = std::min(vec::dot(-r_in.direction(), hit.normal()), Real(1));
+      Real sin_theta = std::sqrt(1 - cos_theta*cos_theta);
+      bool can_refract = ri * sin_theta <= 1;
 
       Vec direction;
-      if (!can_refract || utils::reflectance(cos_theta, ri) > random::rand())
-        direction = glm::reflect(r_in.direction(), hit.normal());
+      if (!can_refract || utils::reflectance(cos_theta, ri) > random::rand(sampler))
+        direction = vec::reflect(r_in.direction(), hit.normal());
       else
-        direction = glm::refract(r_in.direction(), hit.normal(), ri);
+        direction = vec::refract(r_in.direction(), hit.normal(), ri);
+
+      // dieletric material absorbs nothing
+      return EvalRecord(Colour(1), hit.spawn_ray(direction));
+    }
 
-      // TODO
-      return EvalRecord{
-        Colour(1), // dieletric material absorbs nothing
-        nullptr,
-        make_shared<Ray>(hit.p, direction),
-      };
+    size_t memory_usage() const override {
+      return sizeof(*this);
     }
 
   private:
     // refractive index in vacuum or air,
     // or ratio of the material's refractive index over the refractive index of the enclosing medium
-    double refract_idx;
+    Real refract_idx;
 };
 
 
@@ -0,0 +1,41 @@
+#pragma once
+
+#include "utils/common.hpp"
+#include "material.hpp"
+#include "material_phong.hpp"
+#include "scene_shape.hpp"
+
+// Closed-set dispatch for materials.
+namespace raytracer::dispatch {
+
+
+// Calls func with the material cast to its concrete type, given by its kind tag.
+// With STATIC_DISPATCH, or in kernels specialized for a scene Shape, the calls made by func
+// are resolved at compile time and can be inlined, and only the kinds of the Shape are tested.
+// Otherwise, or for materials of unknown kind, func receives the abstract Material
+// and the calls go through the virtual table.
+template<typename Shape = shape::Generic, typename Func>
+inline auto visit(const Material& m, Func&& func) -> decltype(func(m)) {
+#ifdef STATIC_DISPATCH
+  constexpr bool closed = true;
+#else
+  constexpr bool closed = Shape::closed_materials;
+#endif
+  if constexpr (closed) {
+    if constexpr (Shape::has(MaterialKind::light))
+      if (m.kind == MaterialKind::light) return func(static_cast<const LightMat&>(m));
+    if constexpr (Shape::has(MaterialKind::diffuse))
+      if (m.kind == MaterialKind::diffuse) return func(static_cast<const Diffuse&>(m));
+    if constexpr (Shape::has(MaterialKind::metal))
+      if (m.kind == MaterialKind::metal) return func(static_cast<const Metal&>(m));
+    if constexpr (Shape::has(MaterialKind::dielectric))
+      if (m.kind == MaterialKind::dielectric) return func(static_cast<const Dielectric&>(m));
+    if constexpr (Shape::has(MaterialKind::phong_mirror))
+      if (m.kind == MaterialKind::phong_mirror) return func(static_cast<const PhongMirror&>(m));
+    // Phong is not final (PhongMirror derives from it)
+  }
+  return func(m);
+}
+
+
+} // namespace raytracer::dispatch
@@ -5,7 +5,7 @@
 #include "utils/random.hpp"
 #include "pdf.hpp"
 #include "ray.hpp"
-#include "scene.hpp"
+#include "compiled_scene.hpp"
 #include "material.hpp"
 
 namespace raytracer {
@@ -13,18 +13,26 @@ namespace raytracer {
 // A Phong material that combines ambient, diffuse and specular lighting
 class Phong : public Material {
   public:
-    Phong(const Colour& _albedo, double _shininess)
-      : albedo(_albedo), shininess(_shininess) {}
+    Phong(const Colour& _albedo, Real _shininess)
+      : albedo(_albedo), shininess(_shininess) {
+      kind = MaterialKind::phong;
+    }
+
+    Phong(const Colour& _albedo, Real _shininess, Real _ka, Real _kd, Real _ks)
+      : albedo(_albedo), shininess(_shininess), ka(_ka), kd(_kd), ks(_ks) {
+      kind = MaterialKind::phong;
+    }
 
-    Phong(const Colour& _albedo, double _shininess, double _ka, double _kd, double _ks)
-      : albedo(_albedo), shininess(_shininess), ka(_ka), kd(_kd), ks(_ks) {}
+    EvalRecord evaluate(const CompiledScene& scene, const Ray& r_in, const HitRecord& hit, random::Sampler& sampler) const override {
+      return EvalRecord(phong_shade(r_in, hit, scene, sampler));
+    }
 
-    EvalRecord evaluate(const Scene& scene, const Ray& r_in, const HitRecord& hit) const override {
-      return EvalRecord(phong_shade(r_in, hit, scene));
+    size_t memory_usage() const override {
+      return sizeof(*this);
     }
 
   protected:
-    Colour phong_shade(const Ray& r_in, const HitRecord& hit, const Scene& scene) const {
+    Colour phong_shade(const Ray& r_in, const HitRecord& hit, const CompiledScene& scene, random::Sampler& sampler) const {
       Colour total_amb = scene.ambient_light;
       Colour total_diff = Colour(0);
       Colour total_spec = Colour(0);
@@ -33,69 +41,73 @@ class Phong : public Material {
       Vec view_dir = -r_in.direction();
 
       // try to hit lights in the scene to calculate the shading
-      for (const auto& light : scene.lights.objects) {
+      for (const auto& light : scene.lights) {
         HitRecord shadow_hit;
         auto diff = Colour(0);
         auto spec = Colour(0);
 
         // point lights are sampled once, area lights are sampled multiple times
-        int nsamples = (std::dynamic_pointer_cast<Sphere>(light)) ? 1 : 10;
+        int nsamples = light.object->point_light ? 1 : 10;
         for (int i = 0; i < nsamples; i++) {
-          Point sample = light->sample();
-          Vec light_dir = glm::normalize(sample - hit.p);
+          Point sample = light.object->pdf_sample(hit.p, sampler).p;
+          Vec light_dir = vec::normalize(sample - hit.p);
 
-          auto shadow_ray = Ray(hit.p, light_dir);
-          if (scene.hit(shadow_ray, Interval(0.0001, infinity), shadow_hit)
-              && shadow_hit.object == light) {
+          auto shadow_ray = hit.spawn_ray(light_dir);
+          if (scene.hit(shadow_ray, Interval(0, infinity), shadow_hit)
+              && shadow_hit.object == light.object) {
             // light is visible from the hit point
-            auto lmat = std::static_pointer_cast<LightMat>(light->material);
+            const LightMat* lmat = light.material;
 
             // diffuse
-            Vec light_radiance = lmat->radiance(glm::length(sample - hit.p));
-            double attenuation = std::max(glm::dot(hit.normal(), light_dir), 0.0);
+            Vec light_radiance = lmat->radiance(vec::length(sample - hit.p));
+            Real attenuation = std::max(vec::dot(hit.normal(), light_dir), Real(0));
             diff += attenuation * light_radiance;
 
             // specular
-            Vec reflect_dir = glm::normalize(glm::reflect(-light_dir, hit.normal()));
-            double RdotV = std::pow(std::max(glm::dot(reflect_dir, view_dir), 0.0), shininess);
+            Vec reflect_dir = vec::normalize(vec::reflect(-light_dir, hit.normal()));
+            Real RdotV = std::pow(std::max(vec::dot(reflect_dir, view_dir), Real(0)), shininess);
             spec += light_radiance * RdotV;
           }
         }
-        total_diff += diff/(double)nsamples;
-        total_spec += spec/(double)nsamples;
+        total_diff += diff/(Real)nsamples;
+        total_spec += spec/(Real)nsamples;
       }
       return albedo * (ka*total_amb + kd*total_diff + ks*total_spec);
     }
 
   private:
     Colour albedo;    // colour of the material
-    double shininess; // shininess of the material
-    double ka = 0.5;  // ambient coefficient
-    double kd = 0.5;  // diffuse coefficient
-    double ks = 0.5;  // specular coefficient
+    Real shininess;   // shininess of the material
+    Real ka = 0.5;    // ambient coefficient
+    Real kd = 0.5;    // diffuse coefficient
+    Real ks = 0.5;    // specular coefficient
 };
 
 
 // A PhongMirror material that combines Phong shading with reflection using Schlick's approximation
-class PhongMirror : public Phong {
+class PhongMirror final : public Phong {
   public:
-    PhongMirror(const Colour& _albedo, double _shininess, double _refract_idx)
-      : Phong(_albedo, _shininess), refract_idx(_refract_idx) {}
+    PhongMirror(const Colour& _albedo, Real _shininess, Real _refract_idx)
+      : Phong(_albedo, _shininess), refract_idx(_refract_idx) {
+      kind = MaterialKind::phong_mirror;
+    }
 
-    PhongMirror(const Colour& _albedo, double _shininess, double _ka, double _kd, double _ks, double _refract_idx)
-      : Phong(_albedo, _shininess, _ka, _kd, _ks), refract_idx(_refract_idx) {}
+    PhongMirror(const Colour& _albedo, Real _shininess, Real _ka, Real _kd, Real _ks, Real _refract_idx)
+      : Phong(_albedo, _shininess, _ka, _kd, _ks), refract_idx(_refract_idx) {
+      kind = MaterialKind::phong_mirror;
+    }
 
-    EvalRecord evaluate(const Scene& scene, const Ray& r_in, const HitRecord& hit) const override {
+    EvalRecord evaluate(const CompiledScene& scene, const Ray& r_in, const HitRecord& hit, random::Sampler& sampler) const override {
       // reflection ray
-      Vec reflected = glm::normalize(glm::reflect(r_in.direction(), hit.normal()));
-      Ray reflect_ray(hit.p, reflected);
+      Vec reflected = vec::normalize(vec::reflect(r_in.direction(), hit.normal()));
+      Ray reflect_ray = hit.spawn_ray(reflected);
 
       // evaluate the reflected ray colour
       HitRecord reflect_hit;
       Colour reflect_colour;
-      if (scene.hit(reflect_ray, Interval(0.0001, infinity), reflect_hit)) {
+      if (scene.hit(reflect_ray, Interval(0, infinity), reflect_hit)) {
         // hit, evaluate the material
-        EvalRecord reflect_eval = reflect_hit.object->material->evaluate(scene, reflect_ray, reflect_hit);
+        EvalRecord reflect_eval = reflect_hit.material->evaluate(scene, reflect_ray, reflect_hit, sampler);
         reflect_colour = reflect_eval.colour;
       } else {
         // miss, use scene background colour
@@ -103,15 +115,19 @@ class PhongMirror : public Phong {
       }
 
       // reflectance
-      double cos_theta = std::min(glm::dot(-r_in.direction(), hit.normal()), 1.0);
-      double R = utils::reflectance(cos_theta, refract_idx);
+      Real cos_theta = std::min(vec::dot(-r_in.direction(), hit.normal()), Real(1));
+      Real R = utils::reflectance(cos_theta, refract_idx);
 
       // final colour is a mix of the phong shading and reflected colour
-      return EvalRecord((1-R)*phong_shade(r_in, hit, scene) + R*reflect_colour);
+      return EvalRecord((1-R)*phong_shade(r_in, hit, scene, sampler) + R*reflect_colour);
+    }
+
+    size_t memory_usage() const override {
+      return sizeof(*this);
     }
 
   private:
-    double refract_idx; // refractive index in vacuum or air,
+    Real refract_idx; // refractive index in vacuum or air,
 };
 
 } // namespace raytracer
@@ -14,10 +14,10 @@ class Pdf {
     virtual ~Pdf() = default;
 
     // returns the value of the PDF for a given direction
-    virtual double value(const Vec& direction) const = 0;
+    virtual Real value(const Vec& direction) const = 0;
 
     // generate a random direction according to the PDF
-    virtual Vec generate() const = 0;
+    virtual Vec generate(random::Sampler& sampler) const = 0;
 };
 
 
@@ -25,17 +25,17 @@ class Pdf {
 class CosinePdf : public Pdf {
   public:
     CosinePdf(const Vec& _max_direction)
-     : max_direction(glm::normalize(_max_direction)) {}
+     : max_direction(vec::normalize(_max_direction)) {}
 
     // cosine-weighted PDF
-    double value(const Vec& direction) const override {
-      double cos = glm::dot(glm::normalize(direction), max_direction);
-      return std::max(0.0, cos/M_PI);
+    Real value(const Vec& direction) const override {
+      Real cos = vec::dot(vec::normalize(direction), max_direction);
+      return std::max(Real(0), cos * Real(M_1_PI));
     }
 
     // generate a random direction cosine-weighted in the hemisphere around direction dir
-    Vec generate() const override {
-      return random::sample_hemisphere_cosine(max_direction);
+    Vec generate(random::Sampler& sampler) const override {
+      return random::sample_hemisphere_cosine(sampler, max_direction);
     }
 
   private:
@@ -43,19 +43,66 @@ class CosinePdf : public Pdf {
 };
 
 
+// A small tagged PDF record, stored by value in the EvalRecord of a material
+// so that sampling a new ray does not allocate memory in the render loop.
+class PdfRecord {
+  public:
+    enum class Type { none, cosine, sphere };
+
+    Type type = Type::none; // type of the PDF, none if there is no PDF
+    Vec direction;          // max direction of the cosine-weighted PDF, normalized
+
+    PdfRecord() = default;
+    PdfRecord(Type _type, const Vec& _direction = Vec(0)) : type(_type), direction(_direction) {}
+
+    // PDF for a cosine-weighted hemisphere around a normalized direction
+    static PdfRecord cosine(const Vec& _direction) {
+      return PdfRecord(Type::cosine, _direction);
+    }
+
+    // uniform PDF for a sphere of radius 1
+    static PdfRecord sphere() {
+      return PdfRecord(Type::sphere);
+    }
+
+    // true if the record holds a PDF
+    explicit operator bool() const {
+      return type != Type::none;
+    }
+
+    // returns the value of the PDF for a given direction
+    Real value(const Vec& dir) const {
+      switch (type) {
+        case Type::cosine: return std::max(Real(0), vec::dot(vec::normalize(dir), direction) * Real(M_1_PI));
+        case Type::sphere: return 1 / (4*M_PI);
+        default:           return 0;
+      }
+    }
+
+    // generate a random direction according to the PDF
+    Vec generate(random::Sampler& sampler) const {
+      switch (type) {
+        case Type::cosine: return random::sample_hemisphere_cosine(sampler, direction);
+        case Type::sphere: return random::sample_sphere_uniform(sampler);
+        default:           return Vec(0);
+      }
+    }
+};
+
+
 // PDF for a sphere
 class SpherePdf : public Pdf {
   public:
     SpherePdf() = default;
 
     // uniform PDF for a sphere of radius 1
-    double value(const Vec& direction) const override {
+    Real value(const Vec& direction) const override {
       return 1 / (4*M_PI);
     }
 
     // generate a random direction on the unit sphere
-    Vec generate() const override {
-      return random::sample_sphere_uniform();
+    Vec generate(random::Sampler& sampler) const override {
+      return random::sample_sphere_uniform(sampler);
     }
 };
 
@@ -66,13 +113,14 @@ class PrimitivePdf : public Pdf {
     PrimitivePdf(shared_ptr<Primitive> _object, const Point& _origin)
      : object(_object), origin(_origin) {}
 
-    double value(const Vec& direction) const override {
+    // solid angle density of the direction, as seen from origin
+    Real value(const Vec& direction) const override {
       return object->pdf_value(Ray(origin, direction));
     }
 
-    // generate a random direction on the object
-    Vec generate() const override {
-      return object->sample() - origin;
+    // generate a random direction towards the object, with the density given by value()
+    Vec generate(random::Sampler& sampler) const override {
+      return object->pdf_sample(origin, sampler).p - origin;
     }
 
   private:
@@ -88,13 +136,13 @@ class MixturePdf : public Pdf {
      : pdf1(_pdf1), pdf2(_pdf2) {}
 
     // mixture PDF
-    double value(const Vec& direction) const override {
+    Real value(const Vec& direction) const override {
       return 0.5 * pdf1->value(direction) + 0.5 * pdf2->value(direction);
     }
 
     // generate a random direction according to the mixture PDF
-    Vec generate() const override {
-      return random::rand() < 0.5 ? pdf1->generate() : pdf2->generate();
+    Vec generate(random::Sampler& sampler) const override {
+      return random::rand(sampler) < 0.5 ? pdf1->generate(sampler) : pdf2->generate(sampler);
     }
 
   private:
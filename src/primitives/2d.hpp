@@ -10,6 +10,11 @@
 namespace raytracer {
 
 
+// 2D lights farther than sqrt(CLOSE_K) times their size are sampled by area:
+// seen from there, area sampling is almost uniform in solid angle, and cheaper
+const Real CLOSE_K = 4;
+
+
 // Abstract class that represents an instance of a 2D geometric object in the scene.
 // These primitives are defined by an origin point and two vectors that define the plane
 // where they lie. Each derived class must implement the is_hit() method that checks
@@ -24,14 +29,14 @@ class Primitive2D : public Primitive {
     // ray with the plane where the primitive lies.
     // the intersection point is then checked to be inside the primitive
     bool hit(const Ray& r, Interval ray_t, HitRecord& hit) const override {
-      double denom = glm::dot(normal, r.direction());
+      Real denom = vec::dot(normal, r.direction());
 
       // ray and plane are parallels -> no intersection
       if (std::fabs(denom) < NEAR_ZERO)
         return false;
 
       // calculate the intersection point, t = (d - n*o) / n*d
-      double t = (d - glm::dot(normal, r.origin())) / denom;
+      Real t = (d - vec::dot(normal, r.origin())) / denom;
 
       // intersection point outside of ray interval
       if (!ray_t.contains(t))
@@ -40,8 +45,8 @@ class Primitive2D : public Primitive {
       // planar coordinates of the intersection point (P = origin + u*alpha + v*beta)
       Point p = r.at(t);
       Vec op = p - origin;
-      double alpha = glm::dot(w, glm::cross(op, v));
-      double beta  = glm::dot(w, glm::cross(u, op));
+      Real alpha = vec::dot(w, vec::cross(op, v));
+      Real beta  = vec::dot(w, vec::cross(u, op));
 
       // intersection point outside of primitive boundaries
       // this is the only part where the derived primitives differ
@@ -50,31 +55,33 @@ class Primitive2D : public Primitive {
 
       // HIT !
       hit.t = t;
-      hit.p = p;
-      hit.set_normal(r, normal);
-      hit.object = shared_from_this();
+      hit.u = alpha;
+      hit.v = beta;
       return true;
     }
 
-    // returns a random point in the 2D primitive
+    void finalize(const Ray& r, HitRecord& hit) const override {
+      // project the hit point on the plane to reduce its rounding error
+      hit.p = r.at(hit.t);
+      hit.p -= normal * (vec::dot(normal, hit.p) - d);
+      hit.set_normal(r, normal);
+    }
+
+    // returns a random point in the 2D primitive, uniformly distributed by area
     // sample(), normal and area should be defined by the derived class
-    Sample pdf_sample() const override {
-      return Sample{
-        sample(),
-        normal,
-      };
+    Sample pdf_sample(const Point& from, random::Sampler& sampler) const override {
+      Point p = sample(sampler);
+      return Sample{p, normal, area_pdf(from, p)};
     }
 
-    double pdf_value(const Ray& r) const override {
+    // solid angle density of the direction of r, for points sampled uniformly by area
+    Real pdf_value(const Ray& r) const override {
       // the pdf is zero if the ray does not hit the primitive
       HitRecord hit;
-      if (!this->hit(r, Interval(0.0001, infinity), hit))
+      if (!this->hit(r, Interval(0, infinity), hit))
         return 0.0;
 
-      // PDF = distance^2 / (cos(theta) * area)
-      double cos_theta = fabs(glm::dot(hit.normal(), r.direction()));
-      double dist = hit.t * hit.t * vec::length_squared(r.direction());
-      return dist / (cos_theta * area);
+      return area_pdf(r.origin(), r.at(hit.t));
     }
 
 
@@ -83,52 +90,108 @@ class Primitive2D : public Primitive {
     Point origin; // origin point of the primitive, in the plane
     Vec u, v;     // two vectors that define the plane where the primitive lies
 
+    // solid angle density of the point p seen from the point from, for points sampled uniformly by area
+    Real area_pdf(const Point& from, const Point& p) const {
+      // PDF = distance^2 / (cos(theta) * area)
+      Vec d = p - from;
+      Real dist2 = vec::length_squared(d);
+      Real cos_theta = std::fabs(vec::dot(normal, d)) / std::sqrt(dist2);
+      return dist2 / (cos_theta * area);
+    }
+
+    // true if the primitive is close enough to the point from to be worth sampling in solid angle
+    bool close_to(const Point& from) const {
+      Vec d = from - (origin + (u + v)/Real(2));
+      return vec::length_squared(d) < CLOSE_K * (vec::length_squared(u) + vec::length_squared(v));
+    }
+
+    // true if the projection of the primitive on the sphere of directions, of the given solid angle,
+    // is sampled uniformly in solid angle. Smaller and larger solid angles are sampled by area,
+    // for which the spherical sampling is inaccurate (same bounds as PBRT 4th ed.)
+    static bool spherical_sampling(Real solid_angle) {
+      return solid_angle > Real(3e-4) && solid_angle < Real(6.22);
+    }
+
     // should be called by the constructor of the derived class
     // after setting the origin, u and v fields
     void set_constants() {
       // the normal is ortogonal to the two vectors that define the quad
-      Vec n = glm::cross(u, v);
-      normal = glm::normalize(n);
+      Vec n = vec::cross(u, v);
+      normal = vec::normalize(n);
 
       // d is the constant term of the plane equation [ax + by + cz = d]
       // where (a, b, c) is the normal vector and (x, y, z) is the origin point
-      d = glm::dot(normal, origin);
+      d = vec::dot(normal, origin);
 
       // w is the constant used to find the planar coordinates alpha & beta
       // of a point P in the uv plane (P = origin + u*alpha + v*beta)
-      w = n / glm::dot(n, n);
+      w = n / vec::dot(n, n);
     }
 
 
   // the following members are calculated by the set_constants method
   private:
     Vec w;      // constant used to find the planar coordinates of a point
-    double d;   // constant term of the plane equation [ax + by + cz = d]
+    Real d;     // constant term of the plane equation [ax + by + cz = d]
 
     // check if a 2D point with planar coordinates (alpha, beta) is inside the 2D primitive
-    virtual bool is_hit(double alpha, double beta) const = 0;
+    virtual bool is_hit(Real alpha, Real beta) const = 0;
 };
 
 
 
 // A Quad is defined by an origin point and two vectors that define the plane where the quad lies.
-class Quad : public Primitive2D {
+class Quad final : public Primitive2D {
   public:
     Quad(const Point& _origin, const Vec& _u, const Vec& _v, const shared_ptr<Material>& _material) {
+      kind = PrimitiveKind::quad;
       material = _material;
       origin = _origin;
       u = _u;
       v = _v;
-      area = glm::length(glm::cross(u, v));
+      area = vec::length(vec::cross(u, v));
+      rectangle = std::fabs(vec::dot(u, v)) <= Real(1e-6) * vec::length(u) * vec::length(v);
       set_constants();
     }
 
-    Point sample() const override {
-      return random::sample_quad(origin, u, v);
+    AABB bounding_box() const override {
+      AABB bbox(origin, origin + u + v);
+      bbox.expand(AABB(origin + u, origin + v));
+      return bbox;
+    }
+
+    Point sample(random::Sampler& sampler) const override {
+      return random::sample_quad(sampler, origin, u, v);
+    }
+
+    // close rectangles are sampled uniformly in the solid angle they cover seen from the lit point,
+    // other parallelograms uniformly by area
+    Sample pdf_sample(const Point& from, random::Sampler& sampler) const override {
+      if (rectangle && close_to(from)) {
+        random::SphericalRectangle rect(from, origin, u, v);
+        if (spherical_sampling(rect.solid_angle())) {
+          auto [s, t] = random::rand2(sampler);
+          return Sample{rect.sample(s, t), normal, 1 / rect.solid_angle()};
+        }
+      }
+      return Primitive2D::pdf_sample(from, sampler);
+    }
+
+    Real pdf_value(const Ray& r) const override {
+      if (rectangle && close_to(r.origin())) {
+        random::SphericalRectangle rect(r.origin(), origin, u, v);
+        if (spherical_sampling(rect.solid_angle())) {
+          HitRecord hit;
+          return this->hit(r, Interval(0, infinity), hit) ? 1 / rect.solid_angle() : 0;
+        }
+      }
+      return Primitive2D::pdf_value(r);
     }
 
   private:
-    bool is_hit(double alpha, double beta) const {
+    bool rectangle; // true if u and v are orthogonal
+
+    bool is_hit(Real alpha, Real beta) const {
       return alpha >= 0 && beta >= 0 && alpha <= 1 && beta <= 1;
     }
 };
@@ -136,26 +199,58 @@ class Quad : public Primitive2D {
 
 
 // A Triangle is defined by three points in the 2D plane.
-class Triangle : public Primitive2D {
+class Triangle final : public Primitive2D {
   public:
-    Point a, b, c; // unused but useful for debug
+    Point a, b, c; // vertices
 
     Triangle(const Point& _a, const Point& _b, const Point& _c, const shared_ptr<Material>& _material)
       : a(_a), b(_b), c(_c) {
+      kind = PrimitiveKind::triangle;
       material = _material;
       origin = a;
       u = b - a;
       v = c - a;
-      area = glm::length(glm::cross(u, v)) / 2.0;
+      area = vec::length(vec::cross(u, v)) / 2.0;
       set_constants();
     }
 
-    Point sample() const override {
-      return random::sample_triangle(origin, u, v);
+    AABB bounding_box() const override {
+      AABB bbox(a, b);
+      bbox.expand(AABB(a, c));
+      return bbox;
+    }
+
+    Point sample(random::Sampler& sampler) const override {
+      return random::sample_triangle(sampler, origin, u, v);
+    }
+
+    // close triangles are sampled uniformly in the solid angle they cover seen from the lit point
+    Sample pdf_sample(const Point& from, random::Sampler& sampler) const override {
+      if (close_to(from)) {
+        random::SphericalTriangle tri(from, a, b, c);
+        if (spherical_sampling(tri.solid_angle())) {
+          auto [s, t] = random::rand2(sampler);
+          Vec w = tri.sample(s, t);
+          Real distance = vec::dot(normal, a - from) / vec::dot(normal, w); // to the triangle plane along w
+          return Sample{from + distance*w, normal, 1 / tri.solid_angle()};
+        }
+      }
+      return Primitive2D::pdf_sample(from, sampler);
+    }
+
+    Real pdf_value(const Ray& r) const override {
+      if (close_to(r.origin())) {
+        random::SphericalTriangle tri(r.origin(), a, b, c);
+        if (spherical_sampling(tri.solid_angle())) {
+          HitRecord hit;
+          return this->hit(r, Interval(0, infinity), hit) ? 1 / tri.solid_angle() : 0;
+        }
+      }
+      return Primitive2D::pdf_value(r);
     }
 
   private:
-    bool is_hit(double alpha, double beta) const {
+    bool is_hit(Real alpha, Real beta) const {
       return alpha > 0 && beta > 0 && (alpha + beta <= 1);
     }
 };
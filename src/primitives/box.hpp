@@ -11,7 +11,7 @@
 namespace raytracer {
 
 // A hittable box in 3D space composed by a list of 6 quads.
-class Box : public Primitive {
+class Box final : public Primitive {
   public:
     Point pmin, pmax; // unused but useful for debug
 
@@ -36,35 +36,65 @@ class Box : public Primitive {
       faces.add(make_shared<Quad>(pmin,  dx,  dz, _mat)); // bottom
 
       // primitive properties
-      area = 2 * (dx.y * dx.z + dy.x * dy.z + dz.x * dz.y);
+      kind = PrimitiveKind::box;
+      area = 2 * (dx.x * dy.y + dy.y * dz.z + dz.z * dx.x);
       material = _mat;
+
+      // faces are sampled proportionally to their area
+      std::vector<Real> areas;
+      for (const auto& face : faces.objects)
+        areas.push_back(face->area);
+      face_table = random::AliasTable(areas);
     }
 
     // Checks if the ray intersects any of the 6 quads
-    // and sets the object pointer to the box.
+    // and stores the index of the hit face in prim_id.
     bool hit(const Ray& r, Interval ray_t, HitRecord& hit) const override {
-      // the ray intersects the box if it intersects any of the 6 quads
-      // the only correction needed is to set the object pointer to the box
-      return faces.hit(r, ray_t, hit) && (hit.object = shared_from_this());
+      int face = faces.closest_hit<dispatch_as<Quad, Primitive>>(r, ray_t, hit);
+      if (face < 0)
+        return false;
+      hit.prim_id = face;
+      return true;
+    }
+
+    void finalize(const Ray& r, HitRecord& hit) const override {
+      static_cast<const dispatch_as<Quad, Primitive>&>(*faces.objects[hit.prim_id]).finalize(r, hit);
+    }
+
+    AABB bounding_box() const override {
+      return AABB(pmin, pmax);
+    }
+
+    // the 6 quad faces of the box
+    const HittableList& get_faces() const {
+      return faces;
     }
 
-    // TODO - this is not uniform (smaller faces are more densely sampled)
-    Point sample() const override {
-      int idx = random::rand_int(0, 5);
-      return faces.objects[idx].get()->sample();
+    // returns a random point on the surface of the box, uniformly distributed by area
+    Point sample(random::Sampler& sampler) const override {
+      int idx = face_table.sample(sampler);
+      return faces.objects[idx]->sample(sampler);
     }
 
-    Sample pdf_sample() const override {
-      int idx = random::rand_int(0, faces.objects.size() - 1);
-      auto t = std::static_pointer_cast<Quad>(faces.objects[idx]);
-      return Sample{t->sample(), t->normal};
+    Sample pdf_sample(const Point& from, random::Sampler& sampler) const override {
+      int idx = face_table.sample(sampler);
+      Sample sample = static_cast<const Quad*>(faces.objects[idx].get())->pdf_sample(from, sampler);
+      sample.pdf *= face_table.probability(idx);
+      return sample;
     }
 
-    // TODO: support pdf sampling
-    // double pdf_value(const Ray& r) const override {}
+    // solid angle density of the first point hit by r
+    Real pdf_value(const Ray& r) const override {
+      HitRecord hit;
+      int face = faces.closest_hit<dispatch_as<Quad, Primitive>>(r, Interval(0, infinity), hit);
+      if (face < 0)
+        return 0.0;
+      return faces.objects[face]->pdf_value(r) * face_table.probability(face);
+    }
 
   private:
     HittableList faces;
+    random::AliasTable face_table; // distribution of the sampled faces
 };
 
 } // namespace raytracer
@@ -12,59 +12,101 @@
 
 namespace raytracer {
 
+// Optional preprocessing steps applied to a mesh loaded from an obj file.
+// All steps are disabled by default, so the faces are used verbatim.
+class MeshOptions {
+  public:
+    bool weld = false;              // merge vertices that fall in the same cell of a weld_epsilon grid
+    bool remove_degenerate = false; // drop faces with repeated vertices or (near) zero area
+    bool reorder = false;           // sort faces and vertices along a Morton (Z-order) curve
+    Real weld_epsilon = 1e-6;       // grid cell size used to weld vertices
+};
+
+
 // The Mesh primitive is a list of triangles with a bounding box to speed up the intersection tests.
 // This is still a simple implementation, very inefficient and experimental.
 // To simplify code, it makes use of the existing Triangle and Box primitives,
 // although this is not the most efficient way to implement a mesh.
-class Mesh : public Primitive {
+class Mesh final : public Primitive {
   public:
     Mesh() = default;
     ~Mesh() = default;
 
     // create mesh from list of triangles
     Mesh(const HittableList _triangles, const shared_ptr<Material> _material) {
+      kind = PrimitiveKind::mesh;
       material = _material;
       triangles = _triangles;
       compute_bbox();
     }
 
-    // create mesh from obj file
-    Mesh(const std::string& filename, const shared_ptr<Material>& _material) {
+    // create mesh from obj file, optionally preprocessing its vertices and faces
+    Mesh(const std::string& filename, const shared_ptr<Material>& _material,
+         const MeshOptions& options = MeshOptions()) {
+      kind = PrimitiveKind::mesh;
       material = _material;
-      load_obj(filename);
+      load_obj(filename, options);
     }
 
     bool hit(const Ray& r, Interval ray_t, HitRecord& hit) const override {
       // the ray can only hit the mesh if it hits the bounding box first
-      if (!bbox->hit(r, ray_t, hit))
+      HitRecord bbox_hit;
+      if (!bbox->hit(r, ray_t, bbox_hit))
         return false;
 
-      // if the ray hits any triangle, the hit object is the mesh
+      // if the ray hits any triangle, the hit object is the mesh and prim_id is the triangle index
       // this is the bottleneck in this implementation, as it iterates over all triangles
-      return triangles.hit(r, ray_t, hit) && (hit.object = shared_from_this());
+      int triangle = triangles.closest_hit<dispatch_as<Triangle, Primitive>>(r, ray_t, hit);
+      if (triangle < 0)
+        return false;
+      hit.prim_id = triangle;
+      return true;
+    }
+
+    void finalize(const Ray& r, HitRecord& hit) const override {
+      static_cast<const dispatch_as<Triangle, Primitive>&>(*triangles.objects[hit.prim_id]).finalize(r, hit);
+    }
+
+    AABB bounding_box() const override {
+      return bbox->bounding_box();
     }
 
-    // TODO - this is not uniform (smaller faces are more densely sampled)
-    Point sample() const override {
-      int idx = random::rand_int(0, triangles.objects.size() - 1);
-      return triangles.objects[idx]->sample();
+    // the triangles of the mesh
+    const HittableList& get_triangles() const {
+      return triangles;
     }
 
-    Sample pdf_sample() const override {
-      int idx = random::rand_int(0, triangles.objects.size() - 1);
-      auto t = std::static_pointer_cast<Triangle>(triangles.objects[idx]);
-      return Sample{t->sample(), t->normal};
+    // returns a random point on the surface of the mesh, uniformly distributed by area
+    Point sample(random::Sampler& sampler) const override {
+      int idx = triangle_table.sample(sampler);
+      return triangles.objects[idx]->sample(sampler);
     }
 
-    // TODO: support pdf sampling (properly)
-    // double pdf_value(const Ray& r) const override {}
+    Sample pdf_sample(const Point& from, random::Sampler& sampler) const override {
+      int idx = triangle_table.sample(sampler);
+      Sample sample = static_cast<const Triangle*>(triangles.objects[idx].get())->pdf_sample(from, sampler);
+      sample.pdf *= triangle_table.probability(idx);
+      return sample;
+    }
+
+    // solid angle density of the first point hit by r
+    Real pdf_value(const Ray& r) const override {
+      HitRecord hit;
+      int triangle = triangles.closest_hit<dispatch_as<Triangle, Primitive>>(r, Interval(0, infinity), hit);
+      if (triangle < 0)
+        return 0.0;
+      return triangles.objects[triangle]->pdf_value(r) * triangle_table.probability(triangle);
+    }
 
   private:
     HittableList triangles;
     shared_ptr<Box> bbox;   // TODO: replace by a proper BVH
+    random::AliasTable triangle_table; // distribution of the sampled triangles
 
-    // compute the bounding box of the mesh
+    // compute the bounding box and the area of the mesh,
+    // and the table that samples the triangles proportionally to their area
     void compute_bbox() {
+      std::vector<Real> areas;
       Point pmin = Point( infinity,  infinity,  infinity);
       Point pmax = Point(-infinity, -infinity, -infinity);
       for (const auto& triangle : triangles.objects) {
@@ -75,21 +117,28 @@ class Mesh : public Primitive {
         pmax.x = utils::max({pmax.x, t.a.x, t.b.x, t.c.x});
         pmax.y = utils::max({pmax.y, t.a.y, t.b.y, t.c.y});
         pmax.z = utils::max({pmax.z, t.a.z, t.b.z, t.c.z});
+        areas.push_back(t.area);
       }
       bbox = make_shared<Box>(pmin, pmax, material);
+      triangle_table = random::AliasTable(areas);
+      area = 0;
+      for (Real a : areas) area += a;
       // std::clog << "bbox: " << bbox->pmin.x << " " << bbox->pmin.y << " " << bbox->pmin.z << " " << bbox->pmax.x << " " << bbox->pmax.y << " " << bbox->pmax.z << std::endl;
     }
 
+    // a face is a triplet of indices in the vertex list
+    using Face = std::array<int, 3>;
+
     // load a mesh from an obj file (only simple triangulated meshes supported)
-    void load_obj(const std::string& filename) {
+    void load_obj(const std::string& filename, const MeshOptions& options) {
       std::ifstream file(filename);
       if (!file.is_open()) {
         std::cerr << "Error: could not open file " << filename << std::endl;
         return;
       }
 
-      triangles = HittableList();
       std::vector<Point> vertices;
+      std::vector<Face> faces;
       std::string line;
       while (std::getline(file, line)) {
         std::istringstream iss(line);
@@ -98,20 +147,152 @@ class Mesh : public Primitive {
         if (token == "v") {
           Point p;
           iss >> p.x >> p.y >> p.z;
-          // std::clog << p.x << " " << p.y << " " << p.z << " " << vertices.size() << std::endl;
           vertices.push_back(p);
         } else if (token == "f") {
           int i, j, k;
           iss >> i >> j >> k;
-          // std::clog << i << " " << j << " " << k << " " << vertices.size() << " ";
-          auto t = make_shared<Triangle>(vertices[i-1], vertices[j-1], vertices[k-1], material);
-          // std::clog << t->a.x << " " << t->a.y << " " << t->a.z << std::endl;
-          triangles.add(t);
+          faces.push_back(Face{i-1, j-1, k-1});
         }
       }
       file.close();
+
+      preprocess(vertices, faces, options);
+
+      triangles = HittableList();
+      for (const auto& f : faces) {
+        auto t = make_shared<Triangle>(vertices[f[0]], vertices[f[1]], vertices[f[2]], material);
+        triangles.add(t);
+      }
       compute_bbox();
     }
+
+
+    // MESH PREPROCESSING //
+
+    // memory used by the indexed representation of the mesh (vertex and face lists)
+    static size_t indexed_bytes(const std::vector<Point>& vertices, const std::vector<Face>& faces) {
+      return vertices.size()*sizeof(Point) + faces.size()*sizeof(Face);
+    }
+
+    // memory used by the triangle list built from the faces
+    static size_t triangle_bytes(size_t nfaces) {
+      return nfaces * (sizeof(Triangle) + sizeof(shared_ptr<Primitive>));
+    }
+
+    // run the preprocessing steps enabled in options, reporting the savings of each one
+    static void preprocess(std::vector<Point>& vertices, std::vector<Face>& faces, const MeshOptions& options) {
+      auto run = [&](const char* step, const std::function<void()>& func) {
+        size_t nverts = vertices.size(), nfaces = faces.size();
+        size_t before = indexed_bytes(vertices, faces) + triangle_bytes(faces.size());
+        auto start = std::chrono::high_resolution_clock::now();
+        func();
+        auto end = std::chrono::high_resolution_clock::now();
+        size_t after = indexed_bytes(vertices, faces) + triangle_bytes(faces.size());
+
+        std::clog << "Mesh " << step << ": "
+                  << nverts << " -> " << vertices.size() << " vertices, "
+                  << nfaces << " -> " << faces.size() << " faces, "
+                  << (long long)before - (long long)after << " bytes saved, "
+                  << std::chrono::duration<double>(end-start).count() << " seconds" << std::endl;
+      };
+
+      if (options.weld)
+        run("weld", [&]() { weld_vertices(vertices, faces, options.weld_epsilon); });
+      if (options.remove_degenerate)
+        run("degenerate removal", [&]() { remove_degenerate_faces(vertices, faces); });
+      if (options.reorder)
+        run("reorder", [&]() { reorder_faces(vertices, faces); });
+    }
+
+    // merge vertices that quantize to the same cell of a grid with cell size epsilon.
+    // vertices closer than epsilon but lying in neighbouring cells are not merged.
+    static void weld_vertices(std::vector<Point>& vertices, std::vector<Face>& faces, Real epsilon) {
+      std::map<std::array<long long, 3>, int> cells; // grid cell -> index of the welded vertex
+      std::vector<int> remap(vertices.size());
+      std::vector<Point> welded;
+      for (int i = 0; i < (int)vertices.size(); i++) {
+        const Point& p = vertices[i];
+        std::array<long long, 3> key = {
+          (long long)std::floor(p.x / epsilon),
+          (long long)std::floor(p.y / epsilon),
+          (long long)std::floor(p.z / epsilon),
+        };
+        auto it = cells.find(key);
+        if (it == cells.end()) {
+          it = cells.emplace(key, (int)welded.size()).first;
+          welded.push_back(p);
+        }
+        remap[i] = it->second;
+      }
+
+      for (auto& f : faces)
+        for (auto& idx : f) idx = remap[idx];
+      vertices.swap(welded);
+    }
+
+    // remove faces that reference the same vertex twice or have (near) zero area
+    static void remove_degenerate_faces(const std::vector<Point>& vertices, std::vector<Face>& faces) {
+      auto degenerate = [&](const Face& f) {
+        if (f[0] == f[1] || f[1] == f[2] || f[0] == f[2]) return true;
+        Vec n = vec::cross(vertices[f[1]] - vertices[f[0]], vertices[f[2]] - vertices[f[0]]);
+        return vec::length_squared(n) < NEAR_ZERO*NEAR_ZERO;
+      };
+      faces.erase(std::remove_if(faces.begin(), faces.end(), degenerate), faces.end());
+    }
+
+    // sort faces by the Morton code of their centroid, then renumber the vertices
+    // in the order they are first referenced, so that neighbouring faces and their
+    // vertices are close in memory. Unreferenced vertices are dropped.
+    static void reorder_faces(std::vector<Point>& vertices, std::vector<Face>& faces) {
+      if (faces.empty()) return;
+
+      // bounds of the face centroids, used to normalize them in [0,1]^3
+      std::vector<Point> centroids(faces.size());
+      Point cmin = Point( infinity), cmax = Point(-infinity);
+      for (size_t i = 0; i < faces.size(); i++) {
+        const Face& f = faces[i];
+        centroids[i] = (vertices[f[0]] + vertices[f[1]] + vertices[f[2]]) / Real(3);
+        cmin = vec::min(cmin, centroids[i]);
+        cmax = vec::max(cmax, centroids[i]);
+      }
+      Vec extent = vec::max(cmax - cmin, Vec(NEAR_ZERO));
+
+      std::vector<std::pair<uint32_t, Face>> keyed(faces.size());
+      for (size_t i = 0; i < faces.size(); i++)
+        keyed[i] = {morton_code((centroids[i] - cmin) / extent), faces[i]};
+      std::stable_sort(keyed.begin(), keyed.end(),
+        [](const std::pair<uint32_t, Face>& a, const std::pair<uint32_t, Face>& b) { return a.first < b.first; });
+
+      std::vector<int> remap(vertices.size(), -1);
+      std::vector<Point> reordered;
+      for (size_t i = 0; i < keyed.size(); i++) {
+        faces[i] = keyed[i].second;
+        for (auto& idx : faces[i]) {
+          if (remap[idx] < 0) {
+            remap[idx] = (int)reordered.size();
+            reordered.push_back(vertices[idx]);
+          }
+          idx = remap[idx];
+        }
+      }
+      vertices.swap(reordered);
+    }
+
+    // 30-bit Morton code of a point in [0,1]^3 (10 bits per axis)
+    static uint32_t morton_code(const Point& p) {
+      // spread the lower 10 bits of x so that there are two zero bits between each bit
+      auto expand_bits = [](uint32_t x) {
+        x = (x * 0x00010001u) & 0xFF0000FFu;
+        x = (x * 0x00000101u) & 0x0F00F00Fu;
+        x = (x * 0x00000011u) & 0xC30C30C3u;
+        x = (x * 0x00000005u) & 0x49249249u;
+        return x;
+      };
+      auto quantize = [](Real v) {
+        return (uint32_t)std::min(std::max(v * 1024.0, 0.0), 1023.0);
+      };
+      return (expand_bits(quantize(p.x)) << 2) | (expand_bits(quantize(p.y)) << 1) | expand_bits(quantize(p.z));
+    }
 };
 
 } // namespace raytracer
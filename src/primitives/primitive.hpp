@@ -1,7 +1,9 @@
 #pragma once
 
 #include "../utils/common.hpp"
+#include "../utils/random.hpp"
 #include "../hittable/hittable.hpp"
+#include "../hittable/aabb.hpp"
 
 namespace raytracer {
 
@@ -9,36 +11,54 @@ namespace raytracer {
 class Material;
 
 
+// Cheap type tags for the concrete primitives, used instead of RTTI on hot paths.
+enum class PrimitiveKind { other, sphere, quad, triangle, box, mesh };
+
+
 // A sample point (with its normal) on a surface of a primitive
 class Sample {
   public:
     Point p;    // sample point in global coordinates
     Vec normal; // normal at the sample point
+    Real pdf;   // solid angle density of the sample seen from the lit point, as given by pdf_value()
 };
 
 
 // Abstract class that represents a primitive of a geometric object in the scene.
-class Primitive : public std::enable_shared_from_this<Primitive>, public Hittable {
+// Primitives are owned by the scene, which keeps them alive while rendering,
+// so hit records and render code refer to them by plain (non-owning) pointers.
+class Primitive : public Hittable {
   public:
-    shared_ptr<Material> material; // material of the object
-    double area;                   // area of the surface of the object
+    shared_ptr<Material> material;              // material of the object
+    Real area;                                  // area of the surface of the object
+    PrimitiveKind kind = PrimitiveKind::other;  // concrete type, set by the derived class
+    bool emitter = false;                       // true if the material emits light, set by the scene
+    bool point_light = false;                   // true if Phong shading samples the emitter once, as a point light, set by the scene
 
     virtual ~Primitive() = default;
 
+    // Intersection test, implemented by the derived class.
+    // On a hit, it should only record the intersection fields of the hit record (t, prim_id, u, v)
+    // and leave the hit record untouched otherwise.
+    // bool hit(const Ray& r, Interval ray_t, HitRecord& hit) const override;
+
+    // computes the hit point and normal of a hit found by this primitive
+    virtual void finalize(const Ray& r, HitRecord& hit) const = 0;
+
+    // returns the axis-aligned bounding box of the primitive
+    virtual AABB bounding_box() const = 0;
+
     // returns a random point on the surface of the primitive
-    virtual Point sample() const = 0;
-
-    // returns a random point on the primitive with its normal
-    // TODO: transform in pure virtual
-    virtual Sample pdf_sample() const {
-      return Sample{sample(), Vec(0, 0, 0)};
-    }
-
-    // returns the probability density function of the primitive for a given ray
-    // TODO: transform in pure virtual
-    virtual double pdf_value(const Ray& r) const {
-      return 1.0;
-    }
+    virtual Point sample(random::Sampler& sampler) const = 0;
+
+    // returns a random point on the primitive with its normal and density, to light the point from.
+    // Primitives may only sample the part of their surface that can be seen from it
+    virtual Sample pdf_sample(const Point& from, random::Sampler& sampler) const = 0;
+
+    // returns the solid angle density, seen from the origin of r, of the direction of r
+    // for the points sampled by pdf_sample(), 0 if r misses the primitive
+    virtual Real pdf_value(const Ray& r) const = 0;
 };
 
+
 } // namespace raytracer
@@ -11,14 +11,15 @@
 namespace raytracer {
 
 // A hittable sphere in 3D space.
-class Sphere : public Primitive {
+class Sphere final : public Primitive {
   public:
     Point center;
-    double radius;
+    Real radius;
 
-    Sphere(const Point& _center, double _radius, shared_ptr<Material> _material)
-      : center(_center), radius(std::max(0.0, _radius)) {
+    Sphere(const Point& _center, Real _radius, shared_ptr<Material> _material)
+      : center(_center), radius(std::max(Real(0), _radius)) {
       // primitive properties
+      kind = PrimitiveKind::sphere;
       material = _material;
       area = 4*M_PI*radius*radius;
     }
@@ -29,11 +30,11 @@ class Sphere : public Primitive {
     bool hit(const Ray& r, Interval ray_t, HitRecord& hit) const override {
       // t = (-b +- sqrt(b*b - 4*a*c)) / 2*a
       Vec oc = r.origin() - center;                      // oc = A-C
-      double a = glm::dot(r.direction(), r.direction()); // a = dot(B, B)
-      double half_b = glm::dot(oc, r.direction());       // b = 2*dot(oc, B)
-      double oc_length_squared = glm::dot(oc, oc);
-      double c = oc_length_squared - radius*radius;      // c = dot(oc, oc) - R*R
-      double delta = half_b*half_b - a*c;                // delta = b*b - 4*a*c
+      Real a = vec::dot(r.direction(), r.direction()); // a = dot(B, B)
+      Real half_b = vec::dot(oc, r.direction());         // b = 2*dot(oc, B)
+      Real oc_length_squared = vec::dot(oc, oc);
+      Real c = oc_length_squared - radius*radius;        // c = dot(oc, oc) - R*R
+      Real delta = half_b*half_b - a*c;                  // delta = b*b - 4*a*c
 
       // if delta is negative, there are no real roots
       // if delta is zero, there is one real root
@@ -42,8 +43,8 @@ class Sphere : public Primitive {
         return false;
 
       // find the nearest root that lies in the acceptable range.
-      double sqrtd = std::sqrt(delta);
-      double root = (-half_b - sqrtd) / a; // try nearest root
+      Real sqrtd = std::sqrt(delta);
+      Real root = (-half_b - sqrtd) / a; // try nearest root
       if (!ray_t.contains(root)) {
         root = (-half_b + sqrtd) / a;      // try second root
         if (!ray_t.contains(root))
@@ -52,31 +53,90 @@ class Sphere : public Primitive {
 
       // HIT !
       hit.t = root;
-      hit.p = r.at(hit.t);
-      hit.object = shared_from_this();
-      Vec outward_normal = (hit.p-center)/radius; // normalized outward normal
-      hit.set_normal(r, outward_normal);          // store the face orientation
       return true;
     }
 
-    Point sample() const override {
-      return random::sample_sphere_uniform(center, radius);
+    void finalize(const Ray& r, HitRecord& hit) const override {
+      // reproject the hit point on the sphere to reduce its rounding error
+      hit.p = r.at(hit.t);
+      hit.p = center + (hit.p - center) * (radius / vec::length(hit.p - center));
+      hit.set_normal(r, normal(hit.p)); // store the face orientation
     }
 
-    Sample pdf_sample() const override {
-      Point s = sample();
-      return Sample{
-        s,
-        normal(s),
-      };
+    AABB bounding_box() const override {
+      return AABB(center - Vec(radius), center + Vec(radius));
     }
+
+    Point sample(random::Sampler& sampler) const override {
+      return random::sample_sphere_uniform(sampler, center, radius);
+    }
+
+    // Samples uniformly the cone of directions under which the sphere is seen from the lit point,
+    // and returns the point of the sphere seen in the sampled direction, so that only the visible
+    // cap is sampled (PBRT 4th ed., 6.2.4). From inside the sphere, the whole surface is sampled uniformly.
+    Sample pdf_sample(const Point& from, random::Sampler& sampler) const override {
+      Vec oc = center - from;
+      Real dist2 = vec::length_squared(oc);
+      if (dist2 <= radius*radius) {
+        Point s = sample(sampler);
+        return Sample{s, normal(s), area_pdf(from, s)};
+      }
+
+      // cone of the sphere, of half angle theta_max
+      Real sin2_max = radius*radius / dist2;
+      Real cos_max = std::sqrt(std::max(1 - sin2_max, Real(0)));
+      Real one_minus_cos_max = sin2_max / (1 + cos_max); // accurate for small cones
+
+      // direction of angle theta to the cone axis, with cos(theta) uniform in [cos_max, 1]
+      auto [u, v] = random::rand2(sampler);
+      Real one_minus_cos = u * one_minus_cos_max;
+      Real cos_theta = 1 - one_minus_cos;
+      Real sin2_theta = one_minus_cos * (2 - one_minus_cos);
+
+      // angle alpha, at the center, between the axis and the point hit in that direction
+      Real cos_alpha = sin2_theta / std::sqrt(sin2_max)
+                     + cos_theta * std::sqrt(std::max(1 - sin2_theta / sin2_max, Real(0)));
+      Real sin_alpha = std::sqrt(std::max(1 - cos_alpha*cos_alpha, Real(0)));
+      Real s, c;
+      random::sincos_2pi(v, s, c);
+
+      // the normal points back to the lit point, around the axis
+      Vec n = vec::change_basis(oc / std::sqrt(dist2), Vec(-sin_alpha*c, -sin_alpha*s, -cos_alpha));
+      return Sample{center + radius*n, n, 1 / (2*Real(M_PI) * one_minus_cos_max)};
+    }
+
+    // solid angle density of the direction of r for pdf_sample(): uniform in the cone of the sphere
+    Real pdf_value(const Ray& r) const override {
+      Vec oc = center - r.origin();
+      Real dist2 = vec::length_squared(oc);
+      if (dist2 <= radius*radius) {
+        HitRecord hit;
+        if (!this->hit(r, Interval(0, infinity), hit))
+          return 0.0;
+        return area_pdf(r.origin(), r.at(hit.t));
+      }
+
+      // directions out of the cone miss the sphere
+      Real sin2_max = radius*radius / dist2;
+      Real cos_max = std::sqrt(std::max(1 - sin2_max, Real(0)));
+      if (vec::dot(r.direction(), oc) < cos_max * std::sqrt(dist2))
+        return 0.0;
+      return 1 / (2*Real(M_PI) * sin2_max / (1 + cos_max));
+    }
+
+    // solid angle density of the point p seen from the point from, for points sampled uniformly on the surface
+    Real area_pdf(const Point& from, const Point& p) const {
+      // PDF = distance^2 / (cos(theta) * area)
+      Vec d = p - from;
+      Real dist2 = vec::length_squared(d);
+      Real cos_theta = std::fabs(vec::dot(normal(p), d)) / std::sqrt(dist2);
+      return dist2 / (cos_theta * area);
+    }
+
     // normalized outward normal for point p in the surface of the sphere
     Vec normal(Point p) const {
       return (p - center) / radius;
     }
-
-    // TODO: support pdf sampling
-    // double pdf_value(const Ray& r) const override {}
 };
 
 } // namespace raytracer
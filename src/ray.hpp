@@ -1,6 +1,7 @@
 #pragma once
 
 #include "utils/common.hpp"
+#include "utils/vec.hpp"
 
 namespace raytracer {
 
@@ -9,12 +10,12 @@ class Ray {
   public:
     Ray() {}
     Ray(const Point& _origin, const Vec& _direction)
-      : orig(_origin), dir(glm::normalize(_direction)) {}
+      : orig(_origin), dir(vec::normalize(_direction)) {}
 
     Point origin() const { return orig; }
     Vec direction() const { return dir; }
 
-    Point at(double t) const {
+    Point at(Real t) const {
       return orig + t*dir;
     }
 
@@ -0,0 +1,58 @@
+#pragma once
+
+#include "utils/common.hpp"
+#include "primitives/primitive.hpp"
+#include "material.hpp"
+
+namespace raytracer {
+
+// bit of a primitive or material kind in the masks of a SceneShape
+constexpr unsigned kind_bit(PrimitiveKind kind) { return 1u << static_cast<unsigned>(kind); }
+constexpr unsigned kind_bit(MaterialKind kind) { return 1u << static_cast<unsigned>(kind); }
+
+
+// The kinds of leaf primitives and materials supported by a render kernel, as bit masks.
+// The traversal and shading code instantiated for a shape leaves out the other kinds.
+template<unsigned Primitives, unsigned Materials>
+class SceneShape {
+  public:
+    static constexpr unsigned primitives = Primitives;
+    static constexpr unsigned materials = Materials;
+
+    static constexpr bool has(PrimitiveKind kind) { return primitives & kind_bit(kind); }
+    static constexpr bool has(MaterialKind kind) { return materials & kind_bit(kind); }
+
+    // true if the shape has a single primitive kind, which then needs no test
+    static constexpr bool only(PrimitiveKind kind) { return primitives == kind_bit(kind); }
+
+    // true if the shape lists its material kinds, which can then be called by their concrete type
+    static constexpr bool closed_materials = (materials != ~0u);
+};
+
+
+// The shapes that have a specialized kernel.
+namespace shape {
+
+constexpr unsigned PATH_TRACING_MATERIALS = kind_bit(MaterialKind::light) | kind_bit(MaterialKind::diffuse)
+                                          | kind_bit(MaterialKind::metal) | kind_bit(MaterialKind::dielectric);
+
+using Spheres = SceneShape<kind_bit(PrimitiveKind::sphere), PATH_TRACING_MATERIALS>;
+using SpheresQuads = SceneShape<kind_bit(PrimitiveKind::sphere) | kind_bit(PrimitiveKind::quad), PATH_TRACING_MATERIALS>;
+using Generic = SceneShape<~0u, ~0u>;
+
+// Calls func(shape) with the first shape that supports the given primitive and material kinds.
+// The generic shape supports any scene.
+template<typename Func>
+inline void select(unsigned primitives, unsigned materials, Func&& func) {
+  auto fits = [&](auto shape) {
+    using S = decltype(shape);
+    return (primitives & ~S::primitives) == 0 && (materials & ~S::materials) == 0;
+  };
+  if (fits(Spheres()))           func(Spheres());
+  else if (fits(SpheresQuads())) func(SpheresQuads());
+  else                           func(Generic());
+}
+
+} // namespace shape
+
+} // namespace raytracer
@@ -4,6 +4,10 @@
 #include <iostream>         // std::cout, std::clog, std::flush
 #include <memory>           // shared_ptr, make_shared, shared_ptr_cast
 #include <vector>           // std::vector
+#include <array>            // std::array
+#include <map>              // std::map
+#include <unordered_map>    // std::unordered_map
+#include <cstdint>          // uint32_t, uint64_t
 #include <cstdlib>          // rand
 #include <cmath>            // sqrt, fabs
 #include <limits>           // infinity
@@ -13,11 +17,16 @@
 #include <initializer_list> // std::initializer_list
 #include <fstream>          // std::ifstream
 #include <sstream>          // std::stringstream
+#include <new>              // std::align_val_t, std::bad_alloc
 
 // includes from lib/
 #include <glm.hpp>            // algebra
 // #include <tiny_obj_loader.h>  // object loading
 
+#ifdef SIMD
+#include "simd.hpp"           // SIMD vector type
+#endif
+
 
 /* USINGS */
 using std::unique_ptr;
@@ -28,13 +37,42 @@ using std::make_shared;
 namespace raytracer {
 
 /* CLASS ALIASES */
-using Vec = glm::dvec3;
-using Point = glm::dvec3;
-using Colour = glm::dvec3;
+// Floating point type of the renderer math, single precision with SINGLE_PRECISION.
+#ifdef SINGLE_PRECISION
+using Real = float;
+#else
+using Real = double;
+#endif
+
+// Vector types, glm vectors or, with SIMD, padded vectors stored in SSE/AVX registers.
+// Vector algebra must go through raytracer::vec (dot, cross, normalize...), which works with both.
+#ifdef SIMD
+using Vec = simd::Vec3<Real>;
+#else
+using Vec = glm::vec<3, Real>;
+#endif
+using Point = Vec;
+using Colour = Vec;
+
+
+/* DISPATCH */
+// Static type used to call the methods of an object whose concrete type T is known.
+// With STATIC_DISPATCH it is T itself, so calls are resolved at compile time
+// (T must be final) and can be inlined. Otherwise it is the abstract Base class
+// and calls go through the virtual table.
+#ifdef STATIC_DISPATCH
+template<typename T, typename Base> using dispatch_as = T;
+#else
+template<typename T, typename Base> using dispatch_as = Base;
+#endif
 
 
 /* CONSTANTS */
-const double NEAR_ZERO = 1e-8;
-const double infinity = std::numeric_limits<double>::infinity();
+const Real NEAR_ZERO = 1e-8;
+const Real infinity = std::numeric_limits<Real>::infinity();
+
+// scale of the offset of ray origins away from surfaces, relative to the magnitude of the hit point,
+// a few hundred ulps to cover the rounding error of the hit point computation
+const Real RAY_OFFSET_SCALE = 256 * std::numeric_limits<Real>::epsilon();
 
 } // namespace raytracer
@@ -0,0 +1,83 @@
+#pragma once
+
+#include "common.hpp"
+
+namespace raytracer {
+
+// Pixel formats of the framebuffer accumulation buffer, in single precision.
+// rgb:  12 bytes per pixel, all pixels have the same number of samples, given to the framebuffer.
+// rgba: 16 bytes per pixel (aligned), the alpha channel counts the samples of each pixel,
+//       for progressive and adaptive sampling.
+enum class PixelFormat { rgb, rgba };
+
+
+// A contiguous image buffer that accumulates the sum of the samples of each pixel.
+// The pixels are stored in scanline order or, if tile_size > 0, tile by tile
+// (each tile in scanline order), so that a render thread writing a tile stays in cache.
+class Framebuffer {
+  public:
+    Framebuffer() = default;
+
+    Framebuffer(int _width, int _height, int _samples, PixelFormat _format = PixelFormat::rgb, int _tile_size = 0)
+      : width(_width), height(_height), format(_format), tile_size(_tile_size), samples(_samples) {
+      channels = (format == PixelFormat::rgba) ? 4 : 3;
+      if (tile_size > 0) {
+        // the image is padded to a whole number of tiles
+        tiles_x = (width + tile_size - 1) / tile_size;
+        int tiles_y = (height + tile_size - 1) / tile_size;
+        data.assign((size_t)tiles_x * tiles_y * tile_size * tile_size * channels, 0.0f);
+      } else {
+        data.assign((size_t)width * height * channels, 0.0f);
+      }
+    }
+
+    int get_width() const { return width; }
+    int get_height() const { return height; }
+
+    // adds the sum of n samples to the pixel (i, j), n is only stored by the rgba format
+    void add(int i, int j, const Colour& sum, int n) {
+      float* pixel = &data[index(i, j)];
+      pixel[0] += (float)sum.r;
+      pixel[1] += (float)sum.g;
+      pixel[2] += (float)sum.b;
+      if (channels == 4) pixel[3] += (float)n;
+    }
+
+    // number of samples accumulated in the pixel (i, j)
+    int sample_count(int i, int j) const {
+      return (channels == 4) ? (int)data[index(i, j) + 3] : samples;
+    }
+
+    // returns the mean colour of the samples of the pixel (i, j)
+    Colour get(int i, int j) const {
+      const float* pixel = &data[index(i, j)];
+      int n = sample_count(i, j);
+      if (n == 0) return Colour(0);
+      return Colour(pixel[0], pixel[1], pixel[2]) / (Real)n;
+    }
+
+    // memory used by the pixel data, in bytes
+    size_t memory_usage() const {
+      return data.capacity() * sizeof(float);
+    }
+
+  private:
+    int width = 0, height = 0;
+    PixelFormat format = PixelFormat::rgb;
+    int channels = 3;         // floats per pixel
+    int tile_size = 0;        // side of the memory tiles, 0 for scanline order
+    int tiles_x = 0;          // number of tiles in a row of tiles
+    int samples = 0;          // samples per pixel, for formats without per-pixel counts
+    std::vector<float> data;  // accumulated colour of the pixels
+
+    // index of the first channel of the pixel (i, j)
+    size_t index(int i, int j) const {
+      if (tile_size == 0)
+        return ((size_t)j * width + i) * channels;
+      size_t tile = (size_t)(j / tile_size) * tiles_x + (i / tile_size);
+      size_t in_tile = (size_t)(j % tile_size) * tile_size + (i % tile_size);
+      return (tile * tile_size * tile_size + in_tile) * channels;
+    }
+};
+
+} // namespace raytracer
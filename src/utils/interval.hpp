@@ -7,14 +7,14 @@ namespace raytracer {
 // A closed numbers interval [min, max].
 class Interval {
   public:
-    double min, max;
+    Real min, max;
 
     Interval() : min(+INFINITY), max(-INFINITY) {}
-    Interval(double _min, double _max) : min(_min), max(_max) {}
+    Interval(Real _min, Real _max) : min(_min), max(_max) {}
 
-    bool contains(double x) const  { return min <= x && x <= max; }
-    bool surrounds(double x) const { return min < x && x < max; }
-    double clamp(double x) const { return std::min(std::max(x, min), max); }
+    bool contains(Real x) const  { return min <= x && x <= max; }
+    bool surrounds(Real x) const { return min < x && x < max; }
+    Real clamp(Real x) const { return std::min(std::max(x, min), max); }
 
     static const Interval empty, universe;
 };
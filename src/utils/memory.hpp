@@ -0,0 +1,123 @@
+#pragma once
+
+#include "common.hpp"
+#include <iomanip> // std::setprecision
+
+#ifdef TRACK_ALLOCATIONS
+#include <atomic> // std::atomic
+#endif
+
+// Memory accounting of the renderer and, with TRACK_ALLOCATIONS, counting of heap allocations.
+namespace raytracer::memory {
+
+
+// Memory used by each subsystem of the renderer, in bytes.
+class Report {
+  public:
+    size_t geometry = 0;    // leaf primitives and their references
+    size_t bvh = 0;         // acceleration structure
+    size_t materials = 0;   // material table and materials
+    size_t lights = 0;      // light table and light BVH
+    size_t framebuffer = 0; // image pixel data
+
+    size_t total() const {
+      return geometry + bvh + materials + lights + framebuffer;
+    }
+
+    void print(std::ostream& out) const {
+      auto line = [&](const char* name, size_t bytes) {
+        out << "  " << name << std::string(14 - std::string(name).size(), ' ')
+            << std::fixed << std::setprecision(3) << bytes / (1024.0*1024.0) << " MB" << std::endl;
+      };
+      auto flags = out.flags();
+      out << "Memory usage:" << std::endl;
+      line("geometry", geometry);
+      line("BVH", bvh);
+      line("materials", materials);
+      line("lights", lights);
+      line("framebuffer", framebuffer);
+      line("total", total());
+      out.flags(flags);
+    }
+};
+
+
+// ALLOCATION TRACKING //
+
+#ifdef TRACK_ALLOCATIONS
+inline std::atomic<size_t> allocation_count{0};        // heap allocations since the start of the program
+inline std::atomic<size_t> render_allocation_count{0}; // heap allocations inside render loops
+#endif
+
+// true if heap allocations are counted
+constexpr bool tracking_allocations() {
+#ifdef TRACK_ALLOCATIONS
+  return true;
+#else
+  return false;
+#endif
+}
+
+// number of heap allocations since the start of the program, always 0 without TRACK_ALLOCATIONS
+inline size_t allocations() {
+#ifdef TRACK_ALLOCATIONS
+  return allocation_count.load(std::memory_order_relaxed);
+#else
+  return 0;
+#endif
+}
+
+
+// adds n heap allocations made inside a render loop
+inline void add_render_allocations([[maybe_unused]] size_t n) {
+#ifdef TRACK_ALLOCATIONS
+  render_allocation_count.fetch_add(n, std::memory_order_relaxed);
+#endif
+}
+
+// number of heap allocations made inside render loops, which should be 0. Always 0 without TRACK_ALLOCATIONS
+inline size_t render_allocations() {
+#ifdef TRACK_ALLOCATIONS
+  return render_allocation_count.load(std::memory_order_relaxed);
+#else
+  return 0;
+#endif
+}
+
+
+} // namespace raytracer::memory
+
+
+#ifdef TRACK_ALLOCATIONS
+// Replacements of the global allocation functions that count the allocations.
+// They are defined in this header because the raytracer is built as a single translation unit.
+// GCC warns on free() after inlining the replaced operator new, whose memory comes from malloc().
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+void* operator new(std::size_t size) {
+  raytracer::memory::allocation_count.fetch_add(1, std::memory_order_relaxed);
+  if (void* p = std::malloc(size ? size : 1)) return p;
+  throw std::bad_alloc();
+}
+
+void* operator new(std::size_t size, std::align_val_t align) {
+  raytracer::memory::allocation_count.fetch_add(1, std::memory_order_relaxed);
+  // aligned_alloc needs a size multiple of the alignment
+  size_t a = static_cast<size_t>(align);
+  if (void* p = std::aligned_alloc(a, (size + a - 1) / a * a)) return p;
+  throw std::bad_alloc();
+}
+
+void* operator new[](std::size_t size) { return operator new(size); }
+void* operator new[](std::size_t size, std::align_val_t align) { return operator new(size, align); }
+
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+void operator delete(void* p, std::align_val_t) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t, std::align_val_t) noexcept { std::free(p); }
+void operator delete[](void* p) noexcept { std::free(p); }
+void operator delete[](void* p, std::size_t) noexcept { std::free(p); }
+void operator delete[](void* p, std::align_val_t) noexcept { std::free(p); }
+void operator delete[](void* p, std::size_t, std::align_val_t) noexcept { std::free(p); }
+#pragma GCC diagnostic pop
+#endif
@@ -2,50 +2,247 @@
 
 #include "common.hpp"
 #include "vec.hpp"
+#include "sampler.hpp"
 
 using namespace raytracer;
 
 // Utility functions for random number generation and sampling.
+// The random numbers come from a Sampler, always passed explicitly, so that each render
+// thread samples from its own samplers without shared state.
 namespace raytracer::random {
 
 
+// converts a 32-bit fixed point number to a real in [0,1).
+inline Real to_real(uint32_t x) {
+  // as many bits as the mantissa holds, so that the result never rounds to 1
+  if constexpr (std::numeric_limits<Real>::digits < 32)
+    return Real(x >> (32 - std::numeric_limits<Real>::digits))
+         * (Real(1) / Real(1u << std::numeric_limits<Real>::digits));
+  else
+    return Real(x) * Real(1.0 / 4294967296.0);
+}
+
 // returns a random real in [0,1).
-inline double rand() {
-  return std::rand() / (RAND_MAX + 1.0);
+inline Real rand(Sampler& sampler) {
+  return to_real(sampler.next_1d());
+}
+
+// returns a random point in [0,1)^2, stratified in 2D by the low-discrepancy samplers.
+inline std::array<Real, 2> rand2(Sampler& sampler) {
+  auto u = sampler.next_2d();
+  return {to_real(u[0]), to_real(u[1])};
 }
 
 // returns a random real in [min,max).
-inline double rand(double min, double max) {
-  return min + (max-min)*rand();
+inline Real rand(Sampler& sampler, Real min, Real max) {
+  return min + (max-min)*rand(sampler);
 }
 
 // returns a random integer in [min,max].
-inline double rand_int(int min, int max) {
-  return min + std::rand() % (max - min + 1);
+inline int rand_int(Sampler& sampler, int min, int max) {
+  uint64_t range = (uint64_t)(max - min + 1);
+  return min + (int)((sampler.next_1d() * range) >> 32);
 }
 
-// returns a random sample in the quad defined by the point p and the vectors u and v
-inline Point sample_quad(Point p, Vec u, Vec v) {
-  return p + rand()*u + rand()*v;
+/////// WARPS ///////
+
+// The warps map points of [0,1)^2 to the sampled domains. They have no branches nor
+// library calls other than sqrt, the polynomial sincos is cheaper than libm sin and cos.
+
+// sin and cos of 2*pi*u for u in [0,1], with polynomials accurate to 1e-11
+inline void sincos_2pi(Real u, Real& s, Real& c) {
+  // reduce to t in [-pi/4, pi/4] around the nearest quarter turn q
+  int q = (int)(4*u + Real(0.5));
+  Real t = Real(2*M_PI) * (u - q*Real(0.25));
+  Real t2 = t*t;
+  Real sin_t = t * (1 + t2*(Real(-1.0/6) + t2*(Real(1.0/120) + t2*(Real(-1.0/5040)
+             + t2*(Real(1.0/362880) + t2*Real(-1.0/39916800))))));
+  Real cos_t = 1 + t2*(Real(-1.0/2) + t2*(Real(1.0/24) + t2*(Real(-1.0/720)
+             + t2*(Real(1.0/40320) + t2*(Real(-1.0/3628800) + t2*Real(1.0/479001600))))));
+
+  // rotate by q quarter turns
+  Real a = (q & 1) ? cos_t : sin_t;
+  Real b = (q & 1) ? sin_t : cos_t;
+  s = (q & 2) ? -a : a;
+  c = ((q + 1) & 2) ? -b : b;
+}
+
+// uniform point (x, y) in the unit disk
+inline void warp_disk(Real u, Real v, Real& x, Real& y) {
+  Real rho = std::sqrt(u);               // rho = sqrt(u), uniform in area
+  Real s, c;
+  sincos_2pi(v, s, c);                   // phi = 2pi * v
+  x = rho*c;
+  y = rho*s;
+}
+
+// uniform point (x, y, z) on the unit sphere
+inline void warp_sphere(Real u, Real v, Real& x, Real& y, Real& z) {
+  z = 1 - 2*u;                           // z = random in (-1, 1]
+  Real r = std::sqrt(std::max(1 - z*z, Real(0)));
+  Real s, c;
+  sincos_2pi(v, s, c);                   // phi = 2pi * v
+  x = r*c;                               // x = sqrt(1 - z*z) * cos(phi)
+  y = r*s;                               // y = sqrt(1 - z*z) * sin(phi)
+}
+
+// cosine-weighted direction (x, y, z) in the hemisphere of the z-axis
+// https://raytracing.github.io/books/RayTracingTheRestOfYourLife.html#generatingrandomdirections/cosinesamplingahemisphere
+inline void warp_hemisphere_cosine(Real u, Real v, Real& x, Real& y, Real& z) {
+  Real r = std::sqrt(u);
+  Real s, c;
+  sincos_2pi(v, s, c);                   // phi = 2pi * v
+  x = r*c;                               // x = sqrt(u) * cos(phi)
+  y = r*s;                               // y = sqrt(u) * sin(phi)
+  z = std::sqrt(1 - u);                  // z = sqrt(1 - u)
 }
 
-// returns a stratified sample in the quad defined by the point p and the vectors u and v
-// cell is the index of the grid cell in the stratified sampling grid
-// sqrt_n_samples is the squared root of total number of samples in the grid
-// for pixels, sqrt_n_samples = sqrt(samples_per_pixel)
-inline Point sample_quad_stratified(Point p, Vec u, Vec v, int cell, int sqrt_n_samples) {
-  int n_samples = sqrt_n_samples*sqrt_n_samples;
-  int i = cell / n_samples;
-  int j = cell % n_samples;
-  double u_offset = (i + rand()) / sqrt_n_samples;
-  double v_offset = (j + rand()) / sqrt_n_samples;
-  return p + (u * u_offset) + (v * v_offset);
+
+/////// SPHERICAL POLYGONS ///////
+
+// The projection of a rectangle on the unit sphere around a point, sampled uniformly in solid angle
+// (Urena et al. 2013, "An Area-Preserving Parametrization for Spherical Rectangles").
+class SphericalRectangle {
+  public:
+    // the rectangle of corner s and orthogonal edges ex and ey, seen from the point _o
+    SphericalRectangle(const Point& _o, const Point& s, const Vec& ex, const Vec& ey) : o(_o) {
+      // local frame of the rectangle, with z pointing away from it
+      Real ex_length = vec::length(ex), ey_length = vec::length(ey);
+      x = ex / ex_length;
+      y = ey / ey_length;
+      z = vec::cross(x, y);
+      Vec d = s - o;
+      z0 = vec::dot(d, z);
+      if (z0 > 0) {
+        z = -z;
+        z0 = -z0;
+      }
+      x0 = vec::dot(d, x);
+      y0 = vec::dot(d, y);
+      x1 = x0 + ex_length;
+      y1 = y0 + ey_length;
+
+      // normals of the planes through o and each edge, and the angles between them
+      Vec v00(x0, y0, z0), v01(x0, y1, z0), v10(x1, y0, z0), v11(x1, y1, z0);
+      Vec n0 = vec::normalize(vec::cross(v00, v10));
+      Vec n1 = vec::normalize(vec::cross(v10, v11));
+      Vec n2 = vec::normalize(vec::cross(v11, v01));
+      Vec n3 = vec::normalize(vec::cross(v01, v00));
+      Real g0 = vec::angle_between(n0, -n1);
+      Real g1 = vec::angle_between(n1, -n2);
+      Real g2 = vec::angle_between(n2, -n3);
+      Real g3 = vec::angle_between(n3, -n0);
+      b0 = n0.z;
+      b1 = n2.z;
+      k = Real(2*M_PI) - g2 - g3;
+      area = g0 + g1 - k;
+      if (!(area > 0)) area = 0; // o in the plane of the rectangle
+    }
+
+    // solid angle of the rectangle seen from o
+    Real solid_angle() const {
+      return area;
+    }
+
+    // point of the rectangle for the point (u, v) in [0,1)^2, uniformly distributed in solid angle
+    Point sample(Real u, Real v) const {
+      // x coordinate of the point, such that the solid angle at its left is u*area
+      Real au = u*area + k;
+      Real fu = (std::cos(au)*b0 - b1) / std::sin(au);
+      Real cu = std::clamp(std::copysign(1 / std::sqrt(fu*fu + b0*b0), fu), Real(-1), Real(1));
+      Real xu = std::clamp(-(cu*z0) / std::sqrt(1 - cu*cu), x0, x1);
+
+      // y coordinate, such that the solid angle below it is the fraction v of the column at xu
+      Real d = std::sqrt(xu*xu + z0*z0);
+      Real h0 = y0 / std::sqrt(d*d + y0*y0);
+      Real h1 = y1 / std::sqrt(d*d + y1*y1);
+      Real hv = h0 + v*(h1 - h0);
+      Real yv = (hv*hv < 1 - Real(1e-6)) ? hv*d / std::sqrt(1 - hv*hv) : y1;
+      return o + xu*x + yv*y + z0*z;
+    }
+
+  private:
+    Point o;             // center of the sphere
+    Vec x, y, z;         // local frame of the rectangle
+    Real x0, y0, x1, y1; // bounds of the rectangle in the local frame
+    Real z0;             // distance of the rectangle plane, negative
+    Real b0, b1, k;      // constants of the parametrization
+    Real area;           // solid angle
+};
+
+
+// The projection of a triangle on the unit sphere around a point, sampled uniformly in solid angle
+// (Arvo 1995, "Stratified Sampling of Spherical Triangles", as written in PBRT 4th ed., 6.5.4).
+class SphericalTriangle {
+  public:
+    // the triangle of vertices p0, p1, p2, seen from the point o
+    SphericalTriangle(const Point& o, const Point& p0, const Point& p1, const Point& p2) {
+      a = vec::normalize(p0 - o);
+      b = vec::normalize(p1 - o);
+      c = vec::normalize(p2 - o);
+
+      // normals of the planes through o and each edge, the angles between them are the
+      // angles of the spherical triangle, whose area is their spherical excess
+      Vec n_ab = vec::cross(a, b), n_bc = vec::cross(b, c), n_ca = vec::cross(c, a);
+      if (vec::length_squared(n_ab) == 0 || vec::length_squared(n_bc) == 0 || vec::length_squared(n_ca) == 0)
+        return; // o in the plane of the triangle
+      n_ab = vec::normalize(n_ab);
+      n_bc = vec::normalize(n_bc);
+      n_ca = vec::normalize(n_ca);
+      alpha = vec::angle_between(n_ab, -n_ca);
+      Real beta = vec::angle_between(n_bc, -n_ab);
+      Real gamma = vec::angle_between(n_ca, -n_bc);
+      area = std::max(alpha + beta + gamma - Real(M_PI), Real(0));
+    }
+
+    // solid angle of the triangle seen from o
+    Real solid_angle() const {
+      return area;
+    }
+
+    // direction from o to the triangle for the point (u, v) in [0,1)^2, uniformly distributed in solid angle
+    Vec sample(Real u, Real v) const {
+      // the sub-triangle a, b, c' of area u*area has its vertex c' on the arc from a to c
+      Real area_pi = Real(M_PI) + u*area;
+      Real sin_alpha = std::sin(alpha), cos_alpha = std::cos(alpha);
+      Real sin_phi = std::sin(area_pi)*cos_alpha - std::cos(area_pi)*sin_alpha;
+      Real cos_phi = std::cos(area_pi)*cos_alpha + std::sin(area_pi)*sin_alpha;
+      Real k1 = cos_phi + cos_alpha;
+      Real k2 = sin_phi - sin_alpha*vec::dot(a, b);
+      Real cos_bp = (k2 + (k2*cos_phi - k1*sin_phi)*cos_alpha) / ((k2*sin_phi + k1*cos_phi)*sin_alpha);
+      cos_bp = std::clamp(cos_bp, Real(-1), Real(1));
+      Real sin_bp = std::sqrt(std::max(1 - cos_bp*cos_bp, Real(0)));
+      Vec cp = cos_bp*a + sin_bp*orthogonal(c, a);
+
+      // the direction is on the arc from b to c', at a fraction of its length given by v
+      Real cos_theta = 1 - v*(1 - vec::dot(cp, b));
+      Real sin_theta = std::sqrt(std::max(1 - cos_theta*cos_theta, Real(0)));
+      return cos_theta*b + sin_theta*orthogonal(cp, b);
+    }
+
+  private:
+    Vec a, b, c;       // directions to the vertices, normalized
+    Real alpha = 0;    // angle of the spherical triangle at a
+    Real area = 0;     // solid angle
+
+    // the part of v orthogonal to the normalized vector w, normalized (Gram-Schmidt)
+    static Vec orthogonal(const Vec& v, const Vec& w) {
+      return vec::normalize(v - vec::dot(v, w)*w);
+    }
+};
+
+
+/////// SAMPLING ///////
+
+// returns a random sample in the quad defined by the point p and the vectors u and v
+inline Point sample_quad(Sampler& sampler, Point p, Vec u, Vec v) {
+  auto [a, b] = rand2(sampler);
+  return p + a*u + b*v;
 }
 
 // returns a random sample in the triangle defined by the point a and the vectors u and v
-inline Point sample_triangle(Point a, Vec u, Vec v) {
-  double alpha = rand();
-  double beta = rand();
+inline Point sample_triangle(Sampler& sampler, Point a, Vec u, Vec v) {
+  auto [alpha, beta] = rand2(sampler);
   if (alpha + beta > 1) {
     alpha = 1 - alpha;
     beta = 1 - beta;
@@ -54,75 +251,128 @@ inline Point sample_triangle(Point a, Vec u, Vec v) {
 }
 
 // returns a random sample in the disk of radius r at z=0
-inline Point sample_disk(double r) {
-  double phi = 2 * M_PI * rand();   // phi = random in [0, 2pi)
-  return Point(r*cos(phi), r*sin(phi), 0);
+inline Point sample_disk(Sampler& sampler, Real r) {
+  auto [u, v] = rand2(sampler);
+  Real x, y;
+  warp_disk(u, v, x, y);
+  return Point(r*x, r*y, 0);
 }
 
-// returns a sample in the given CDF
-inline int sample_cdf(const std::vector<double>& cdf) {
-  double r = rand();
-  for (int i = 0; i < (int)cdf.size(); i++) {
-    if (cdf[i] > r) return i;
-  }
-  return -1; // should never happen
-}
+// Discrete distribution sampled in constant time (Walker's alias method, built with Vose's algorithm).
+// The n outcomes share n bins of probability 1/n: bin i holds outcome i with probability q,
+// and its alias with probability 1-q.
+class AliasTable {
+  public:
+    AliasTable() = default;
+
+    // distribution proportional to the given non-negative weights, uniform if they are all zero
+    explicit AliasTable(const std::vector<Real>& weights) {
+      int n = (int)weights.size();
+      double total = 0;
+      for (Real w : weights) total += w;
+
+      bins.resize(n);
+      std::vector<double> scaled(n); // probabilities times n, 1 for an average outcome
+      std::vector<int> small, large;
+      for (int i = 0; i < n; i++) {
+        bins[i].p = total > 0 ? Real(weights[i] / total) : Real(1) / n;
+        scaled[i] = total > 0 ? weights[i] / total * n : 1;
+        (scaled[i] < 1 ? small : large).push_back(i);
+      }
+
+      // each small outcome fills its bin with the excess of a large one
+      while (!small.empty() && !large.empty()) {
+        int s = small.back(), l = large.back();
+        small.pop_back();
+        bins[s].q = Real(scaled[s]);
+        bins[s].alias = l;
+        scaled[l] -= 1 - scaled[s];
+        if (scaled[l] < 1) {
+          large.pop_back();
+          small.push_back(l);
+        }
+      }
+      // the remaining bins are full, up to rounding errors
+      for (int i : small) bins[i].q = 1;
+      for (int i : large) bins[i].q = 1;
+    }
+
+    // returns an outcome, from a single dimension of the sampler:
+    // the high bits of the product by n select the bin, the low bits select the outcome in the bin
+    int sample(Sampler& sampler) const {
+      uint64_t x = (uint64_t)sampler.next_1d() * bins.size();
+      const Bin& bin = bins[x >> 32];
+      return to_real((uint32_t)x) < bin.q ? (int)(x >> 32) : bin.alias;
+    }
+
+    // probability of the outcome i
+    Real probability(int i) const {
+      return bins[i].p;
+    }
+
+    size_t size() const {
+      return bins.size();
+    }
+
+  private:
+    struct Bin {
+      Real q = 1;    // probability of the outcome of the bin, rather than its alias
+      int alias = 0; // other outcome of the bin
+      Real p = 0;    // probability of the outcome of the bin in the distribution
+    };
+    std::vector<Bin> bins;
+};
 
 
 /////// VECTOR SAMPLING ///////
 
 
 // returns a random Vec in [0,1)^3.
-inline Vec vec() {
-  return Vec(random::rand(), random::rand(), random::rand());
+inline Vec vec(Sampler& sampler) {
+  return Vec(rand(sampler), rand(sampler), rand(sampler));
 }
 
 // returns a random Vec in [min,max)^3.
-inline Vec vec(double min, double max) {
-  return Vec(random::rand(min, max), random::rand(min, max), random::rand(min, max));
+inline Vec vec(Sampler& sampler, Real min, Real max) {
+  return Vec(rand(sampler, min, max), rand(sampler, min, max), rand(sampler, min, max));
 }
 
 // returns a random unit vector (a point on the surface of the unit sphere).
-inline Vec sample_sphere_uniform() {
-  double z   = random::rand(-1, 1);     // z   = random in [-1, 1)
-  double phi = random::rand(0, 2*M_PI); // phi = random in [0, 2pi)
-  double r = std::sqrt(1 - z*z);
-  double x = r*cos(phi);                 // x = sqrt(1 - z*z) * cos(phi)
-  double y = r*sin(phi);                 // y = sqrt(1 - z*z) * sin(phi)
+inline Vec sample_sphere_uniform(Sampler& sampler) {
+  auto [u, v] = rand2(sampler);
+  Real x, y, z;
+  warp_sphere(u, v, x, y, z);
   return Vec(x, y, z);                   // already unitary
 }
 
 // returns a random sample in the surface of the sphere centered at c with radius r
-inline Vec sample_sphere_uniform(Point c, double r) {
-  return c + r*sample_sphere_uniform();
+inline Vec sample_sphere_uniform(Sampler& sampler, Point c, Real r) {
+  return c + r*sample_sphere_uniform(sampler);
 }
 
 // Returns an uniform sampled unit vector in the hemisphere of the z-axis.
 // The returned vector is always in the hemisphere of the normal vector.
 // This is uniform in the hemisphere of the z-axis,
 // but not uniform in the hemisphere of the normal vector.
-inline Vec sample_hemisphere_uniform(const Vec& normal) {
-  Vec vec = sample_sphere_uniform();
+inline Vec sample_hemisphere_uniform(Sampler& sampler, const Vec& normal) {
+  Vec vec = sample_sphere_uniform(sampler);
   // if the normal and vec are NOT in the same hemisphere, invert vec
-  return (glm::dot(vec, normal) > 0.0) ? vec : -vec;
+  return (vec::dot(vec, normal) > 0.0) ? vec : -vec;
 }
 
 // Returns a cosine sampled vector in the hemisphere of the z-axis.
-// https://raytracing.github.io/books/RayTracingTheRestOfYourLife.html#generatingrandomdirections/cosinesamplingahemisphere
-inline Vec sample_hemisphere_cosine() {
-  double r   = random::rand();          // r   = random in [0, 1)
-  double phi = random::rand(0, 2*M_PI); // phi = random in [0, 2pi)
-  auto x = cos(phi)*sqrt(r);             // x = sqrt(r) * cos(phi)
-  auto y = sin(phi)*sqrt(r);             // y = sqrt(r) * sin(phi)
-  auto z = sqrt(1-r);                    // z = sqrt(1 - r)
+inline Vec sample_hemisphere_cosine(Sampler& sampler) {
+  auto [u, v] = rand2(sampler);
+  Real x, y, z;
+  warp_hemisphere_cosine(u, v, x, y, z);
   return Vec(x, y, z);
 }
 
 // Returns a cosine sampled vector in the hemisphere of the normal.
 // This is cosine-weighted in the hemisphere of the normal vector.
-inline Vec sample_hemisphere_cosine(const Vec& normal) {
-  Vec vec = sample_hemisphere_cosine();
-  return glm::normalize(vec::change_basis(normal, vec)); // TODO: need to normalize ?
+inline Vec sample_hemisphere_cosine(Sampler& sampler, const Vec& normal) {
+  Vec vec = sample_hemisphere_cosine(sampler);
+  return vec::normalize(vec::change_basis(normal, vec)); // TODO: need to normalize ?
 }
 
 
@@ -0,0 +1,254 @@
+#pragma once
+
+#include "common.hpp"
+
+// Random number generators and samplers, the sources of the random numbers of random.hpp.
+namespace raytracer::random {
+
+
+// PCG32 random number generator (https://www.pcg-random.org):
+// a 64-bit linear congruential generator with a permuted 32-bit output.
+// Generators with the same seed and different streams give independent sequences.
+class Pcg32 {
+  public:
+    explicit Pcg32(uint64_t seed = 0, uint64_t stream = 0) {
+      inc = (stream << 1u) | 1u;
+      next_uint();
+      state += seed;
+      next_uint();
+    }
+
+    // returns a uniformly distributed 32-bit integer
+    uint32_t next_uint() {
+      uint64_t old = state;
+      state = old * 6364136223846793005ULL + inc;
+      uint32_t xorshifted = (uint32_t)(((old >> 18u) ^ old) >> 27u);
+      uint32_t rot = (uint32_t)(old >> 59u);
+      return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
+    }
+
+  private:
+    uint64_t state = 0; // LCG state
+    uint64_t inc;       // LCG increment, odd, selects the stream
+};
+
+// SplitMix64 finalizer: scrambles the bits of x, to derive seeds from indices
+inline uint64_t mix(uint64_t x) {
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+// Counter-based random number generator: the n-th number is a hash of a key and of the
+// counter n (the dimension), computed with SplitMix64. Any number of the sequence can be
+// computed directly with get(n), without generating the previous ones.
+class CounterRng {
+  public:
+    explicit CounterRng(uint64_t seed = 0, uint64_t stream = 0) : key(mix(seed ^ mix(stream + 1))) {}
+
+    // returns the number of the given dimension of the sequence
+    uint32_t get(uint32_t dim) const {
+      return (uint32_t)(mix(key + (dim + 1ULL) * 0x9e3779b97f4a7c15ULL) >> 32);
+    }
+
+    // returns the number of the next dimension
+    uint32_t next_uint() {
+      return get(dimension++);
+    }
+
+  private:
+    uint64_t key;           // hash of the seed and the stream
+    uint32_t dimension = 0; // counter, index of the next number
+};
+
+// random number generator of the independent sampler
+#ifdef COUNTER_RNG
+using Rng = CounterRng;
+#else
+using Rng = Pcg32;
+#endif
+
+// Returns the generator of a sample of a pixel, which only depends on the seed,
+// the pixel and the sample index, and not on the thread or on the order of the samples.
+// With COUNTER_RNG, each number of the sample is keyed by (pixel, sample, dimension).
+inline Rng sample_rng(uint64_t seed, uint64_t pixel, uint64_t sample) {
+  return Rng(mix(seed ^ mix(sample)), pixel);
+}
+
+
+// Sample distributions of a Sampler.
+// independent: uniform random numbers from an Rng, without stratification.
+// sobol:       Owen-scrambled Sobol points, stratified for any power of two number of samples.
+// cmj:         correlated multi-jittered points, stratified for samples_per_pixel samples.
+enum class SamplerType { independent, sobol, cmj };
+
+
+// Tables of the second dimension of the Sobol sequence, one per byte of the index:
+// entry x of table b is the xor of the direction numbers of the bits of x << 8b.
+// The direction numbers are v(0) = 1 << 31 and v(k+1) = v(k) ^ (v(k) >> 1).
+constexpr std::array<uint32_t, 4*256> sobol_y_tables() {
+  std::array<uint32_t, 4*256> tables{};
+  uint32_t v = 1u << 31;
+  for (int bit = 0; bit < 32; bit++, v ^= v >> 1) {
+    int b = bit / 8, mask = 1 << (bit % 8);
+    for (int x = 0; x < 256; x++)
+      if (x & mask) tables[b*256 + x] ^= v;
+  }
+  return tables;
+}
+inline constexpr std::array<uint32_t, 4*256> SOBOL_Y_TABLES = sobol_y_tables();
+
+
+// The random numbers of a sample of a pixel, as 32-bit fixed point numbers in [0,1).
+// Each call of next_1d() or next_2d() uses one dimension of the sample. The samples of a pixel
+// are well distributed in each dimension: the pixel position, the lens, and at each bounce the
+// light selection, the light point and the BSDF direction use their own dimensions, as long
+// as the paths of the samples take the same decisions.
+// The numbers only depend on (seed, pixel, sample, dimension), as with a counter-based generator.
+class Sampler {
+  public:
+    Sampler() = default;
+
+    Sampler(SamplerType _type, uint64_t seed, uint64_t pixel, uint32_t _sample, uint32_t _samples)
+      : type(_type), rng(sample_rng(seed, pixel, _sample)), key(mix(seed ^ mix(pixel + 1))),
+        sample(_sample), samples(std::max(_samples, 1u)) {}
+
+    // returns the number of the next dimension
+    uint32_t next_1d() {
+      switch (type) {
+        case SamplerType::sobol: return sobol_1d(dimension++);
+        case SamplerType::cmj:   return cmj_1d(dimension++);
+        default:                 return rng.next_uint();
+      }
+    }
+
+    // returns the point of the next dimension, stratified in 2D
+    std::array<uint32_t, 2> next_2d() {
+      switch (type) {
+        case SamplerType::sobol: return sobol_2d(dimension++);
+        case SamplerType::cmj:   return cmj_2d(dimension++);
+        default:                 return {rng.next_uint(), rng.next_uint()};
+      }
+    }
+
+  private:
+    SamplerType type = SamplerType::independent;
+    Rng rng;                // generator of the independent sampler
+    uint64_t key = 0;       // hash of the seed and the pixel
+    uint32_t sample = 0;    // index of the sample in the pixel
+    uint32_t samples = 1;   // number of samples of the pixel, for cmj
+    uint32_t dimension = 0; // index of the next dimension
+
+    // hash of the pixel, the dimension and an extra index (smaller than 2^32)
+    uint64_t hash(uint32_t dim, uint64_t extra = 0) const {
+      return mix(key + ((uint64_t)dim << 32 | extra) * 0x9e3779b97f4a7c15ULL);
+    }
+
+    // SOBOL //
+
+    static uint32_t reverse_bits(uint32_t x) {
+      x = (x << 16) | (x >> 16);
+      x = ((x & 0x00ff00ff) << 8) | ((x & 0xff00ff00) >> 8);
+      x = ((x & 0x0f0f0f0f) << 4) | ((x & 0xf0f0f0f0) >> 4);
+      x = ((x & 0x33333333) << 2) | ((x & 0xcccccccc) >> 2);
+      x = ((x & 0x55555555) << 1) | ((x & 0xaaaaaaaa) >> 1);
+      return x;
+    }
+
+    // hash-based Owen scrambling of bit-reversed numbers (Laine and Karras 2011, Burley 2020):
+    // each bit is flipped by a hash of the lower bits, which are the higher bits of the number
+    static uint32_t laine_karras(uint32_t x, uint32_t seed) {
+      x += seed;
+      x ^= x * 0x6c50b47cu;
+      x ^= x * 0xb82f1e52u;
+      x ^= x * 0xc7afe638u;
+      x ^= x * 0x8d22f6e6u;
+      return x;
+    }
+
+    static uint32_t owen_scramble(uint32_t x, uint32_t seed) {
+      return reverse_bits(laine_karras(reverse_bits(x), seed));
+    }
+
+    // second dimension of the Sobol sequence
+    static uint32_t sobol_y(uint32_t index) {
+      return SOBOL_Y_TABLES[index & 0xff] ^ SOBOL_Y_TABLES[256 + ((index >> 8) & 0xff)]
+           ^ SOBOL_Y_TABLES[512 + ((index >> 16) & 0xff)] ^ SOBOL_Y_TABLES[768 + (index >> 24)];
+    }
+
+    // the first dimension of the Sobol sequence is the bit reversal of the index,
+    // so its Owen scrambling needs no reversal of the input
+    uint32_t sobol_1d(uint32_t dim) const {
+      uint64_t h = hash(dim);
+      uint32_t index = owen_scramble(sample, (uint32_t)h);
+      return reverse_bits(laine_karras(index, (uint32_t)(h >> 32)));
+    }
+
+    // Padded Owen-scrambled Sobol (Burley 2020, "Practical Hash-based Owen Scrambling"):
+    // every dimension uses the first two Sobol dimensions, with its own shuffle of the sample
+    // indices and its own scrambling, so that the dimensions are not correlated
+    std::array<uint32_t, 2> sobol_2d(uint32_t dim) const {
+      uint64_t h = hash(dim);
+      uint32_t index = owen_scramble(sample, (uint32_t)h);
+      return {
+        reverse_bits(laine_karras(index, (uint32_t)(h >> 32))),
+        owen_scramble(sobol_y(index), (uint32_t)mix(h)),
+      };
+    }
+
+    // CORRELATED MULTI-JITTERED //
+
+    // random permutation of i in [0, l) given by the pattern p (Kensler 2013)
+    static uint32_t permute(uint32_t i, uint32_t l, uint32_t p) {
+      uint32_t w = l - 1;
+      w |= w >> 1; w |= w >> 2; w |= w >> 4; w |= w >> 8; w |= w >> 16;
+      do {
+        i ^= p;             i *= 0xe170893d;
+        i ^= p >> 16;
+        i ^= (i & w) >> 4;
+        i ^= p >> 8;        i *= 0x0929eb3f;
+        i ^= p >> 23;
+        i ^= (i & w) >> 1;  i *= 1 | p >> 27;
+        i *= 0x6935fa69;
+        i ^= (i & w) >> 11; i *= 0x74dcb303;
+        i ^= (i & w) >> 2;  i *= 0x9e501cc3;
+        i ^= (i & w) >> 2;  i *= 0xc860a3df;
+        i &= w;
+        i ^= i >> 5;
+      } while (i >= l);
+      return (i + p) % l;
+    }
+
+    // (stratum + jitter) / strata, with a 32-bit jitter, in fixed point
+    static uint32_t jittered(uint32_t stratum, uint32_t jitter, uint32_t strata) {
+      return (uint32_t)((((uint64_t)stratum << 32) | jitter) / strata);
+    }
+
+    // Sample indices past the number of samples start a new pattern.
+    uint32_t cmj_1d(uint32_t dim) const {
+      uint64_t h = hash(dim, sample / samples);
+      uint32_t s = permute(sample % samples, samples, (uint32_t)h);
+      return jittered(s, (uint32_t)mix(h ^ s), samples);
+    }
+
+    // Correlated multi-jittered sampling (Kensler 2013, "Correlated Multi-Jittered Sampling"):
+    // the samples are in distinct cells of an m x n grid and in distinct rows and columns of
+    // its n x m sub-grid
+    std::array<uint32_t, 2> cmj_2d(uint32_t dim) const {
+      uint32_t m = std::max((uint32_t)std::sqrt((double)samples), 1u);
+      uint32_t n = (samples + m - 1) / m;
+      uint64_t h = hash(dim, sample / samples);
+      uint32_t p = (uint32_t)h;
+      uint32_t s = permute(sample % samples, samples, p * 0x51633e2d);
+      uint32_t sx = permute(s % m, m, p * 0x68bc21eb);
+      uint32_t sy = permute(s / m, n, p * 0x02e5be93);
+      uint64_t j = mix(h ^ s);
+      return {
+        jittered(sx*n + sy, (uint32_t)j, m*n),
+        jittered(s, (uint32_t)(j >> 32), samples),
+      };
+    }
+};
+
+
+} // namespace raytracer::random
@@ -0,0 +1,141 @@
+#pragma once
+
+#include <immintrin.h> // SSE/AVX intrinsics
+#include <cmath>       // sqrt
+
+// A 3D vector type stored in a single SIMD register, used instead of glm when built with SIMD.
+// floats use a 16-byte SSE register and doubles a 32-byte AVX register, the fourth lane is
+// padding: it is kept at zero by the constructors and the operators (division included),
+// and ignored by the reductions (dot, length).
+namespace raytracer::simd {
+
+
+// Register type and lane-wise operations for each scalar type.
+template<typename T> class Lanes;
+
+template<> class Lanes<float> {
+  public:
+    using reg = __m128;
+    static reg set(float x, float y, float z) { return _mm_set_ps(0, z, y, x); }
+    static reg add(reg a, reg b) { return _mm_add_ps(a, b); }
+    static reg sub(reg a, reg b) { return _mm_sub_ps(a, b); }
+    static reg mul(reg a, reg b) { return _mm_mul_ps(a, b); }
+    // the padding lane of b is replaced by 1, so that the padding stays at 0 instead of 0/0
+    static reg div(reg a, reg b) { return _mm_div_ps(a, _mm_blend_ps(b, _mm_set1_ps(1), 0b1000)); }
+    static reg min(reg a, reg b) { return _mm_min_ps(a, b); }
+    static reg max(reg a, reg b) { return _mm_max_ps(a, b); }
+    static reg yzx(reg a) { return _mm_shuffle_ps(a, a, _MM_SHUFFLE(3, 0, 2, 1)); }
+
+    // x + y + z
+    static float sum(reg a) {
+      __m128 s = _mm_add_ss(a, _mm_shuffle_ps(a, a, _MM_SHUFFLE(1, 1, 1, 1)));
+      return _mm_cvtss_f32(_mm_add_ss(s, _mm_movehl_ps(a, a)));
+    }
+};
+
+template<> class Lanes<double> {
+  public:
+    using reg = __m256d;
+    static reg set(double x, double y, double z) { return _mm256_set_pd(0, z, y, x); }
+    static reg add(reg a, reg b) { return _mm256_add_pd(a, b); }
+    static reg sub(reg a, reg b) { return _mm256_sub_pd(a, b); }
+    static reg mul(reg a, reg b) { return _mm256_mul_pd(a, b); }
+    static reg div(reg a, reg b) { return _mm256_div_pd(a, _mm256_blend_pd(b, _mm256_set1_pd(1), 0b1000)); }
+    static reg min(reg a, reg b) { return _mm256_min_pd(a, b); }
+    static reg max(reg a, reg b) { return _mm256_max_pd(a, b); }
+    static reg yzx(reg a) { return _mm256_permute4x64_pd(a, _MM_SHUFFLE(3, 0, 2, 1)); }
+
+    // x + y + z
+    static double sum(reg a) {
+      __m128d xy = _mm256_castpd256_pd128(a);
+      __m128d zw = _mm256_extractf128_pd(a, 1);
+      __m128d s = _mm_add_sd(xy, _mm_unpackhi_pd(xy, xy));
+      return _mm_cvtsd_f64(_mm_add_sd(s, zw));
+    }
+};
+
+
+// A 3D vector of T (float or double), aligned to the size of its register.
+// The component names mirror glm (x, y, z and r, g, b) so it is a drop-in for glm::vec<3, T>.
+template<typename T>
+class alignas(sizeof(typename Lanes<T>::reg)) Vec3 {
+  public:
+    using L = Lanes<T>;
+    using reg = typename L::reg;
+
+    union {
+      reg m;
+      struct { T x, y, z, pad; };
+      struct { T r, g, b, alpha; };
+    };
+
+    Vec3() : m(L::set(0, 0, 0)) {}
+    explicit Vec3(T s) : m(L::set(s, s, s)) {}
+    Vec3(T _x, T _y, T _z) : m(L::set(_x, _y, _z)) {}
+    explicit Vec3(reg _m) : m(_m) {}
+
+    // copies go through the register, a member-wise copy of the union would split
+    // it in smaller loads and stores, and stall the next full-width load
+    Vec3(const Vec3& v) : m(v.m) {}
+    Vec3& operator=(const Vec3& v) { m = v.m; return *this; }
+
+    T& operator[](int i) { return (&x)[i]; }
+    T operator[](int i) const { return (&x)[i]; }
+
+    Vec3 operator-() const { return Vec3(L::sub(L::set(0, 0, 0), m)); }
+
+    Vec3& operator+=(const Vec3& v) { m = L::add(m, v.m); return *this; }
+    Vec3& operator-=(const Vec3& v) { m = L::sub(m, v.m); return *this; }
+    Vec3& operator*=(const Vec3& v) { m = L::mul(m, v.m); return *this; }
+    Vec3& operator/=(const Vec3& v) { m = L::div(m, v.m); return *this; }
+    Vec3& operator*=(T s) { m = L::mul(m, L::set(s, s, s)); return *this; }
+    Vec3& operator/=(T s) { return *this *= (1 / s); }
+
+    // defined as friends so that scalars of other types (int and double literals) convert to T
+    friend Vec3 operator+(Vec3 a, const Vec3& b) { return a += b; }
+    friend Vec3 operator-(Vec3 a, const Vec3& b) { return a -= b; }
+    friend Vec3 operator*(Vec3 a, const Vec3& b) { return a *= b; }
+    friend Vec3 operator/(Vec3 a, const Vec3& b) { return a /= b; }
+    friend Vec3 operator*(Vec3 a, T s) { return a *= s; }
+    friend Vec3 operator*(T s, Vec3 a) { return a *= s; }
+    friend Vec3 operator/(Vec3 a, T s) { return a /= s; }
+    friend Vec3 operator/(T s, const Vec3& a) { return Vec3(s) / a; }
+};
+
+
+// GEOMETRY //
+
+template<typename T>
+inline T dot(const Vec3<T>& a, const Vec3<T>& b) {
+  return Lanes<T>::sum(Lanes<T>::mul(a.m, b.m));
+}
+
+// a x b = (a * b.yzx - a.yzx * b).yzx
+template<typename T>
+inline Vec3<T> cross(const Vec3<T>& a, const Vec3<T>& b) {
+  using L = Lanes<T>;
+  auto c = L::sub(L::mul(a.m, L::yzx(b.m)), L::mul(L::yzx(a.m), b.m));
+  return Vec3<T>(L::yzx(c));
+}
+
+template<typename T>
+inline T length(const Vec3<T>& v) {
+  return std::sqrt(dot(v, v));
+}
+
+template<typename T>
+inline Vec3<T> normalize(const Vec3<T>& v) {
+  return v * (1 / length(v));
+}
+
+template<typename T>
+inline Vec3<T> min(const Vec3<T>& a, const Vec3<T>& b) {
+  return Vec3<T>(Lanes<T>::min(a.m, b.m));
+}
+
+template<typename T>
+inline Vec3<T> max(const Vec3<T>& a, const Vec3<T>& b) {
+  return Vec3<T>(Lanes<T>::max(a.m, b.m));
+}
+
+} // namespace raytracer::simd
@@ -1,6 +1,9 @@
 #pragma once
 
 #include "common.hpp"
+#include "framebuffer.hpp"
+#include "interval.hpp"
+#include "memory.hpp"
 
 using namespace raytracer;
 
@@ -23,22 +26,26 @@ inline T max(std::initializer_list<T> list) {
 }
 
 // Schlick's approximation for reflectance
-inline double reflectance(double cos_theta, double refraction_idx) {
-  double r0 = (1-refraction_idx) / (1+refraction_idx);
+inline Real reflectance(Real cos_theta, Real refraction_idx) {
+  Real r0 = (1-refraction_idx) / (1+refraction_idx);
   r0 = r0*r0;
-  return r0 + (1-r0)*pow((1 - cos_theta), 5);
+  return r0 + (1-r0)*std::pow((1 - cos_theta), 5);
 }
 
 
 // TEST UTILS //
 
+// prints the execution time of func and, with TRACK_ALLOCATIONS, its number of heap allocations
 inline void clock(const std::function<void()>& func) {
+  size_t allocations = memory::allocations();
   auto start = std::chrono::high_resolution_clock::now();
   func();
   auto end = std::chrono::high_resolution_clock::now();
 
   auto duration = std::chrono::duration<double>(end-start).count();
   std::clog << "\nExecution time: " << duration << " seconds" << std::endl;
+  if (memory::tracking_allocations())
+    std::clog << "Heap allocations: " << memory::allocations() - allocations << std::endl;
 }
 
 
@@ -46,7 +53,7 @@ inline void clock(const std::function<void()>& func) {
 // IMAGE UTILS //
 
 // convert linear RGB to gamma corrected RGB
-inline double linear_to_gamma(double linear_component) {
+inline Real linear_to_gamma(Real linear_component) {
   return (linear_component > 0) ? std::sqrt(linear_component) : 0;
 }
 
@@ -56,17 +63,20 @@ void write_pixel(std::ostream &out, Colour pixel) {
   if (pixel.g != pixel.g) pixel.g = 0;
   if (pixel.b != pixel.b) pixel.b = 0;
 
-  out << static_cast<int>(255.999 * linear_to_gamma(pixel.r)) << ' '
-      << static_cast<int>(255.999 * linear_to_gamma(pixel.g)) << ' '
-      << static_cast<int>(255.999 * linear_to_gamma(pixel.b)) << '\n';
+  // clamp the components to [0, 255], the maximum value of the image
+  static const Interval intensity(0, 0.999);
+  out << static_cast<int>(256 * intensity.clamp(linear_to_gamma(pixel.r))) << ' '
+      << static_cast<int>(256 * intensity.clamp(linear_to_gamma(pixel.g))) << ' '
+      << static_cast<int>(256 * intensity.clamp(linear_to_gamma(pixel.b))) << '\n';
 }
 
-void write_image(int image_width, int image_height, std::vector<std::vector<Colour>>& pixels) {
+void write_image(const Framebuffer& framebuffer) {
+  int image_width = framebuffer.get_width(), image_height = framebuffer.get_height();
   std::cout << "P3\n" << image_width << ' ' << image_height << "\n255\n";
   for (int j = 0; j < image_height; ++j) {
     // std::clog << "\rScanlines remaining: " << (image_height - j) << ' ' << std::flush;
     for (int i = 0; i < image_width; ++i) {
-      write_pixel(std::cout, pixels[j][i]);
+      write_pixel(std::cout, framebuffer.get(i, j));
     }
   }
 }
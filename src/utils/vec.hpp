@@ -4,18 +4,35 @@
 
 using namespace raytracer;
 
-// Additional utility functions for vectors.
+// Vector algebra and additional utility functions for vectors.
 namespace raytracer::vec {
 
 
+// algebra of the vector type selected in common.hpp
+#ifdef SIMD
+using simd::dot;
+using simd::cross;
+using simd::length;
+using simd::normalize;
+using simd::min;
+using simd::max;
+#else
+using glm::dot;
+using glm::cross;
+using glm::length;
+using glm::normalize;
+using glm::min;
+using glm::max;
+#endif
+
 // Calculates the orthonormal basis vectors u,v,w from a normal,
 // and then returns the linear combination of them,
 // weighted by the components of the input vector vec.
 inline Vec change_basis(const Vec& normal, const Vec& vec) {
   Vec w = normal;
   Vec a = (fabs(w.x) < 0.9) ? Vec(1,0,0) : Vec(0,1,0); // a vector that is not parallel to w
-  Vec v = glm::normalize(glm::cross(w, a));            // v = w x a, v is perpendicular to w
-  Vec u = glm::cross(w, v);                            // u = w x v, u is perpendicular to w and v
+  Vec v = normalize(cross(w, a));                      // v = w x a, v is perpendicular to w
+  Vec u = cross(w, v);                                 // u = w x v, u is perpendicular to w and v
 
   // TODO: this gives a different result
   // u,v,w are the basis vectors of the local coordinate system.
@@ -30,29 +47,46 @@ inline Vec change_basis(const Vec& normal, const Vec& vec) {
   return u*vec.x + v*vec.y + w*vec.z;
 }
 
+// returns the angle between the normalized vectors a and b,
+// accurate for small angles and for angles close to pi, unlike acos(dot(a, b))
+inline Real angle_between(const Vec& a, const Vec& b) {
+  if (dot(a, b) < 0)
+    return Real(M_PI) - 2*std::asin(std::min(length(a + b) / 2, Real(1)));
+  return 2*std::asin(std::min(length(b - a) / 2, Real(1)));
+}
+
 // true if the vector is close to zero in all dimensions.
 inline bool is_near_zero(const Vec& v) {
   return (std::fabs(v.x) < NEAR_ZERO) && (std::fabs(v.y) < NEAR_ZERO) && (std::fabs(v.z) < NEAR_ZERO);
 }
 
-inline double length_squared(const Vec& v) {
-  return glm::dot(v, v);
+inline Real length_squared(const Vec& v) {
+  return dot(v, v);
 }
 
 // returns the reflection of a vector v around a normal n.
 // v and n must be normalized
 inline Vec reflect(const Vec& v, const Vec& n) {
-  return v - 2*glm::dot(v,n)*n;
+  return v - 2*dot(v,n)*n;
 }
 
 // returns the refraction of a vector uv through a normal n.
-inline Vec refract(const Vec& uv, const Vec& n, double etai_over_etat) {
-  double cos_theta = std::min(dot(-uv, n), 1.0);
+inline Vec refract(const Vec& uv, const Vec& n, Real etai_over_etat) {
+  Real cos_theta = std::min(dot(-uv, n), Real(1));
   Vec r_out_perp =  etai_over_etat * (uv + cos_theta*n);
-  Vec r_out_parallel = -std::sqrt(std::fabs(1.0 - length_squared(r_out_perp))) * n;
+  Vec r_out_parallel = -std::sqrt(std::fabs(1 - length_squared(r_out_perp))) * n;
   return r_out_perp + r_out_parallel;
 }
 
+// Offsets the origin p of a ray leaving a surface with normal n in the direction dir.
+// p is moved along the normal, to the side of dir, by more than the rounding error
+// of the hit point, so the new ray can start at t = 0 without hitting the surface again.
+inline Point offset_ray_origin(const Point& p, const Vec& n, const Vec& dir) {
+  Real magnitude = std::max({std::fabs(p.x), std::fabs(p.y), std::fabs(p.z)});
+  Vec offset = n * (RAY_OFFSET_SCALE * (magnitude + 1));
+  return dot(dir, n) < 0 ? p - offset : p + offset;
+}
+
 // print a Vec
 inline void print(const Vec& v) {
   std::clog << "{" << v.x << ", " << v.y << ", " << v.z << "}" << std::endl;